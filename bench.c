@@ -0,0 +1,435 @@
+//Allocator benchmarks: runs standard workloads against every umem policy and glibc malloc and
+//prints one CSV row per run, so results can be diffed between builds to catch regressions.
+//
+//Build: cc -O2 -o bench bench.c umem.c -lpthread
+//Usage: bench [-a allocator,...] [-w workload,...] [-s scale]
+//
+//Every run happens in a child process of its own, as the region can only be set up once.
+//Throughput counts all operations, latency is sampled on every LATENCY_SAMPLE-th one.
+//RSS is the peak resident growth over the run, fragmentation the share of the resident
+//memory at the end of the run that does not hold live blocks.
+#include "umem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define REGION_SIZE ((size_t)1 << 30)
+#define BASE_OPS (200000)               //Operations per thread at scale 1
+#define SLOTS (4096)                    //Blocks a thread keeps live at most
+#define LATENCY_SAMPLE (8)              //Every this many operations one is timed
+#define RSS_SAMPLE (4096)               //Operations between resident size samples
+#define LARSON_ROUNDS (16)              //Times the threads hand their blocks on
+#define REALLOC_BUFFERS (256)
+#define REALLOC_LIMIT ((size_t)1 << 20)
+#define MAX_THREADS (16)
+
+enum { SIZES_SMALL, SIZES_MEDIUM, SIZES_LARGE, SIZES_MIXED };
+
+typedef struct {
+    const char* name;
+    int algorithm;                      //umeminit policy, 0 for glibc
+} allocator_t;
+
+static const allocator_t allocators[] = {
+    { "glibc", 0 },
+    { "best", BEST_FIT },
+    { "worst", WORST_FIT },
+    { "first", FIRST_FIT },
+    { "next", NEXT_FIT },
+    { "buddy", BUDDY },
+    { "tlsf", TLSF },
+};
+#define ALLOCATOR_COUNT ((int)(sizeof(allocators) / sizeof(allocators[0])))
+
+struct worker;
+typedef struct {
+    const char* name;
+    void (*run)(struct worker* worker);
+    int threads;
+    int sizes;                          //Size distribution of the workload
+} workload_t;
+
+//State of one benchmark thread
+typedef struct worker {
+    const workload_t* workload;
+    int id;
+    size_t ops;
+    unsigned int seed;
+    long* latencies;                    //Sampled operation times in nanoseconds
+    size_t samples;
+    size_t live_bytes;                  //Bytes in the blocks still live at the end
+    size_t failed;                      //Allocations that returned NULL
+} worker_t;
+
+static bool glibc = false;
+static int statm = -1;
+static size_t baseline_rss = 0;
+static size_t peak_rss = 0;
+static pthread_barrier_t barrier;
+static void** larson_slots[MAX_THREADS];
+static size_t* larson_sizes[MAX_THREADS];
+
+static void* bench_alloc(size_t size) {
+    return glibc ? malloc(size) : umalloc(size);
+}
+
+static void bench_free(void* ptr) {
+    if (glibc) {
+        free(ptr);
+    } else {
+        ufree(ptr);
+    }
+}
+
+static void* bench_realloc(void* ptr, size_t size) {
+    return glibc ? realloc(ptr, size) : urealloc(ptr, size);
+}
+
+static long clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+//Resident set size in bytes
+static size_t resident_bytes(void) {
+    char buffer[128];
+    unsigned long pages = 0, resident = 0;
+
+    ssize_t length = pread(statm, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    sscanf(buffer, "%lu %lu", &pages, &resident);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void sample_rss(void) {
+    size_t resident = resident_bytes();
+    if (resident > baseline_rss && resident - baseline_rss > peak_rss) {
+        peak_rss = resident - baseline_rss;
+    }
+}
+
+static size_t draw_size(int sizes, unsigned int* seed) {
+    switch (sizes) {
+        case SIZES_SMALL:
+            return 8 + rand_r(seed) % 121;
+        case SIZES_MEDIUM:
+            return 128 + rand_r(seed) % 3969;
+        case SIZES_LARGE:
+            return 4096 + rand_r(seed) % 61441;
+        default: {
+            //Mostly small requests with a long tail, as most programs make them
+            int roll = rand_r(seed) % 100;
+            return draw_size(roll < 90 ? SIZES_SMALL : roll < 99 ? SIZES_MEDIUM : SIZES_LARGE, seed);
+        }
+    }
+}
+
+//Writes one byte per page, so the block counts towards the resident size like a used one
+static void touch(void* ptr, size_t size) {
+    for (size_t offset = 0; offset < size; offset += 4096) {
+        ((volatile char* )ptr)[offset] = 1;
+    }
+    ((volatile char* )ptr)[size - 1] = 1;
+}
+
+//Allocates or frees the block in one slot, timing every LATENCY_SAMPLE-th call
+static void replace(worker_t* worker, void** slot, size_t* slot_size, size_t size, size_t op) {
+    bool timed = op % LATENCY_SAMPLE == 0;
+    bool freeing = *slot != NULL;
+    long start = timed ? clock_ns() : 0;
+
+    if (freeing) {
+        bench_free(*slot);
+        *slot = NULL;
+    } else {
+        *slot = bench_alloc(size);
+    }
+    if (timed) {
+        worker->latencies[worker->samples++] = clock_ns() - start;
+    }
+
+    //Live bytes are counted per thread, only their sum over all threads is meaningful
+    if (freeing) {
+        worker->live_bytes -= *slot_size;
+        *slot_size = 0;
+    } else if (*slot == NULL) {
+        worker->failed++;
+    } else {
+        touch(*slot, size);
+        *slot_size = size;
+        worker->live_bytes += size;
+    }
+}
+
+//Random allocations and frees over a set of slots, with sizes from one distribution
+static void run_sizes(worker_t* worker) {
+    void* slots[SLOTS] = { NULL };
+    size_t sizes[SLOTS] = { 0 };
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        size_t k = (size_t)rand_r(&worker->seed) % SLOTS;
+        size_t size = slots[k] != NULL ? sizes[k] : draw_size(worker->workload->sizes, &worker->seed);
+        replace(worker, &slots[k], &sizes[k], size, op);
+        if (worker->id == 0 && op % RSS_SAMPLE == 0) {
+            sample_rss();
+        }
+    }
+}
+
+//Larson-style server: every thread replaces blocks at random, then hands its blocks to the next
+//thread, so most blocks are freed by a different thread than the one that allocated them
+static void run_larson(worker_t* worker) {
+    int threads = worker->workload->threads;
+    size_t per_round = worker->ops / LARSON_ROUNDS;
+    size_t op = 0;
+
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        void** slots = larson_slots[(worker->id + round) % threads];
+        size_t* sizes = larson_sizes[(worker->id + round) % threads];
+
+        for (size_t i = 0; i < per_round; i++, op++) {
+            size_t k = (size_t)rand_r(&worker->seed) % SLOTS;
+            replace(worker, &slots[k], &sizes[k], draw_size(worker->workload->sizes, &worker->seed), op);
+            if (worker->id == 0 && op % RSS_SAMPLE == 0) {
+                sample_rss();
+            }
+        }
+        pthread_barrier_wait(&barrier);
+    }
+}
+
+//Buffers that grow by half at a time up to REALLOC_LIMIT and then start over
+static void run_realloc(worker_t* worker) {
+    void* buffers[REALLOC_BUFFERS] = { NULL };
+    size_t sizes[REALLOC_BUFFERS] = { 0 };
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        size_t k = (size_t)rand_r(&worker->seed) % REALLOC_BUFFERS;
+        size_t size = sizes[k] + sizes[k] / 2 + 16;
+        bool timed = op % LATENCY_SAMPLE == 0;
+        long start = timed ? clock_ns() : 0;
+
+        if (size > REALLOC_LIMIT) {
+            bench_free(buffers[k]);
+            buffers[k] = NULL;
+            worker->live_bytes -= sizes[k];
+            sizes[k] = 0;
+        } else {
+            void* ptr = bench_realloc(buffers[k], size);
+            if (ptr == NULL) {
+                worker->failed++;
+            } else {
+                buffers[k] = ptr;
+                worker->live_bytes += size - sizes[k];
+                sizes[k] = size;
+            }
+        }
+        if (timed) {
+            worker->latencies[worker->samples++] = clock_ns() - start;
+        }
+
+        if (buffers[k] != NULL) {
+            touch(buffers[k], sizes[k]);
+        }
+        if (op % RSS_SAMPLE == 0) {
+            sample_rss();
+        }
+    }
+}
+
+//Sizes drift upwards over the run, so the holes left by earlier blocks are too small for later ones
+static void run_churn(worker_t* worker) {
+    void* slots[SLOTS] = { NULL };
+    size_t sizes[SLOTS] = { 0 };
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        size_t k = (size_t)rand_r(&worker->seed) % SLOTS;
+        size_t phase = 1 + op * 8 / worker->ops;
+        size_t size = slots[k] != NULL ? sizes[k] : draw_size(SIZES_MIXED, &worker->seed) * phase;
+        replace(worker, &slots[k], &sizes[k], size, op);
+        if (op % RSS_SAMPLE == 0) {
+            sample_rss();
+        }
+    }
+}
+
+static const workload_t workloads[] = {
+    { "sizes-small", run_sizes, 1, SIZES_SMALL },
+    { "sizes-medium", run_sizes, 1, SIZES_MEDIUM },
+    { "sizes-large", run_sizes, 1, SIZES_LARGE },
+    { "sizes-mixed", run_sizes, 1, SIZES_MIXED },
+    { "larson", run_larson, 4, SIZES_SMALL },
+    { "realloc-growth", run_realloc, 1, SIZES_MIXED },
+    { "churn", run_churn, 1, SIZES_MIXED },
+    { "scaling-1", run_sizes, 1, SIZES_MIXED },
+    { "scaling-2", run_sizes, 2, SIZES_MIXED },
+    { "scaling-4", run_sizes, 4, SIZES_MIXED },
+    { "scaling-8", run_sizes, 8, SIZES_MIXED },
+};
+#define WORKLOAD_COUNT ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+static void* worker_main(void* arg) {
+    worker_t* worker = (worker_t* )arg;
+
+    pthread_barrier_wait(&barrier);
+    worker->workload->run(worker);
+    return NULL;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    long left = *(const long* )a;
+    long right = *(const long* )b;
+    return (left > right) - (left < right);
+}
+
+//Runs one workload on one allocator and prints its row, called in a child process
+static void run(const allocator_t* allocator, const workload_t* workload, size_t ops) {
+    int threads = workload->threads;
+    worker_t workers[MAX_THREADS];
+    pthread_t handles[MAX_THREADS];
+
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (worker_t){ workload, i, ops, (unsigned int)(i + 1) * 7919, NULL, 0, 0, 0 };
+        workers[i].latencies = malloc((ops / LATENCY_SAMPLE + 1) * sizeof(long));
+        memset(workers[i].latencies, 0, (ops / LATENCY_SAMPLE + 1) * sizeof(long));
+        if (workload->run == run_larson) {
+            larson_slots[i] = calloc(SLOTS, sizeof(void* ));
+            larson_sizes[i] = calloc(SLOTS, sizeof(size_t));
+        }
+    }
+
+    //The benchmark's own memory is resident before the baseline is taken
+    statm = open("/proc/self/statm", O_RDONLY);
+    baseline_rss = resident_bytes();
+
+    glibc = allocator->algorithm == 0;
+    if (!glibc) {
+        int algorithm = allocator->algorithm;
+        if (threads > 1) {
+            umemopt(UMEM_OPT_ARENAS, threads);
+            algorithm |= UMEM_THREAD_SAFE;
+        }
+        if (umeminit(REGION_SIZE, algorithm) != 0) {
+            exit(1);
+        }
+    }
+
+    //Worker 0 runs on the calling thread, the others are started and wait at the barrier with it
+    pthread_barrier_init(&barrier, NULL, threads);
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&handles[i], NULL, worker_main, &workers[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    long start = clock_ns();
+    workload->run(&workers[0]);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    long elapsed = clock_ns() - start;
+    sample_rss();
+
+    size_t samples = 0, live_bytes = 0, failed = 0;
+    for (int i = 0; i < threads; i++) {
+        samples += workers[i].samples;
+        live_bytes += workers[i].live_bytes;
+        failed += workers[i].failed;
+    }
+    long* latencies = malloc((samples + 1) * sizeof(long));
+    samples = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(latencies + samples, workers[i].latencies, workers[i].samples * sizeof(long));
+        samples += workers[i].samples;
+    }
+    qsort(latencies, samples, sizeof(long), compare_latencies);
+
+    size_t resident = resident_bytes();
+    resident = resident > baseline_rss ? resident - baseline_rss : 0;
+    double fragmentation = resident > live_bytes ? 1.0 - (double)live_bytes / resident : 0.0;
+    size_t total_ops = ops * threads;
+
+    printf("%s,%s,%d,%zu,%.0f,%ld,%ld,%ld,%zu,%.3f,%zu\n", allocator->name, workload->name, threads, total_ops,
+           total_ops * 1e9 / elapsed, latencies[samples / 2], latencies[samples * 99 / 100],
+           latencies[samples * 999 / 1000], peak_rss >> 10, fragmentation, failed);
+    fflush(stdout);
+}
+
+//Tells whether name is in a comma-separated list, a NULL list holds everything
+static bool selected(const char* list, const char* name) {
+    if (list == NULL) {
+        return true;
+    }
+
+    size_t length = strlen(name);
+    for (const char* item = list; item != NULL; item = strchr(item, ',')) {
+        if (*item == ',') {
+            item++;
+        }
+        if (strncmp(item, name, length) == 0 && (item[length] == ',' || item[length] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char** argv) {
+    const char* allocator_list = NULL;
+    const char* workload_list = NULL;
+    double scale = 1.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:w:s:")) != -1) {
+        switch (opt) {
+            case 'a':
+                allocator_list = optarg;
+                break;
+            case 'w':
+                workload_list = optarg;
+                break;
+            case 's':
+                scale = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-a allocator,...] [-w workload,...] [-s scale]\n", argv[0]);
+                return 2;
+        }
+    }
+    size_t ops = (size_t)(BASE_OPS * scale);
+    if (ops < LARSON_ROUNDS) {
+        ops = LARSON_ROUNDS;
+    }
+
+    printf("allocator,workload,threads,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,rss_kb,fragmentation,failed\n");
+    fflush(stdout);
+
+    int status = 0;
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        for (int a = 0; a < ALLOCATOR_COUNT; a++) {
+            if (!selected(workload_list, workloads[w].name) || !selected(allocator_list, allocators[a].name)) {
+                continue;
+            }
+
+            pid_t child = fork();
+            if (child == 0) {
+                run(&allocators[a], &workloads[w], ops);
+                _exit(0);
+            }
+
+            int result;
+            if (child < 0 || waitpid(child, &result, 0) < 0 || !WIFEXITED(result) || WEXITSTATUS(result) != 0) {
+                fprintf(stderr, "%s on %s did not finish.\n", workloads[w].name, allocators[a].name);
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
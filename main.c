@@ -1,6 +1,9 @@
 #include "umem.h"
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/resource.h>
 
 int main(){
     //main_test();
@@ -8,6 +11,24 @@ int main(){
     //coalesce_test();
     next_fit_test2();
     //worst_fit_test();
+    //buddy_test();
+    //tlsf_test();
+    //thread_cache_test();
+    //arena_test();
+    //growth_test();
+    //trim_test();
+    //slab_test();
+    //mmap_test();
+    //heap_test();
+    //align_test();
+    //batch_test();
+    //sized_test();
+    //quick_bin_test();
+    //calloc_test();
+    //trace_test();
+    //stats_test();
+    //profile_test();
+    //init_failure_test();
 }
 
 //umalloc,free, realloc testing
@@ -280,4 +301,529 @@ int worst_fit_test() {
     umemstats();
 
     return 0;
-}
\ No newline at end of file
+}
+int buddy_test() {
+    umeminit(4096, BUDDY);
+    printf("Initialized memory with Buddy algorithm.\n");
+    print_free_list();
+
+    //Each request is rounded up to a power-of-two block (header included)
+    void *ptr1 = umalloc(100);   //128-byte block
+    void *ptr2 = umalloc(40);    //64-byte block
+    void *ptr3 = umalloc(500);   //1024-byte block
+    printf("Allocated ptr1 (100), ptr2 (40) and ptr3 (500):\n");
+    print_free_list();
+
+    //Growing within the block capacity keeps the pointer
+    ptr1 = urealloc(ptr1, 110);
+    printf("Grew ptr1 to 110 bytes in place: %p\n", ptr1);
+
+    //Freeing buddies merges them back up to the full region
+    ufree(ptr2);
+    ufree(ptr1);
+    printf("Freed ptr1 and ptr2:\n");
+    print_free_list();
+
+    ufree(ptr3);
+    printf("Freed ptr3, region should be a single block again:\n");
+    print_free_list();
+
+    umemstats();
+
+    return 0;
+}
+
+int tlsf_test() {
+    umeminit(4096, TLSF);
+    printf("Initialized memory with TLSF algorithm.\n");
+
+    void *ptr1 = umalloc(100);
+    void *ptr2 = umalloc(200);
+    void *ptr3 = umalloc(300);
+    printf("Allocated ptr1 (100), ptr2 (200) and ptr3 (300):\n");
+    print_free_list();
+
+    //Freeing the middle block leaves it on its own size-class list
+    ufree(ptr2);
+    printf("Freed ptr2:\n");
+    print_free_list();
+
+    //ptr1 grows in place into the free block after it
+    ptr1 = urealloc(ptr1, 250);
+    printf("Grew ptr1 to 250 bytes: %p\n", ptr1);
+    print_free_list();
+
+    //Freeing the rest merges everything back through the boundary tags
+    ufree(ptr1);
+    ufree(ptr3);
+    printf("Freed ptr1 and ptr3:\n");
+    print_free_list();
+
+    umemstats();
+
+    return 0;
+}
+
+//Worker for thread_cache_test: repeatedly allocates and frees small blocks
+static void *thread_cache_worker(void *arg) {
+    void *ptrs[64];
+    (void)arg;
+
+    for (int round = 0; round < 1000; round++) {
+        for (int i = 0; i < 64; i++) {
+            ptrs[i] = umalloc(16 + (i % 8) * 16);
+        }
+        for (int i = 0; i < 64; i++) {
+            ufree(ptrs[i]);
+        }
+    }
+    return NULL;
+}
+
+int thread_cache_test() {
+    umeminit(1 << 20, FIRST_FIT | UMEM_THREAD_SAFE);
+    printf("Initialized memory with First Fit in thread-safe mode.\n");
+
+    //Each worker serves most requests from its own cache and only locks to refill or drain
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, thread_cache_worker, NULL);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    //Exiting threads hand their cached blocks back, so the heap is whole again
+    printf("All workers finished:\n");
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+//Worker for arena_test: allocates blocks too large for the thread cache and returns them to main
+static void *arena_worker(void *arg) {
+    void **ptrs = (void **)arg;
+
+    for (int round = 0; round < 1000; round++) {
+        for (int i = 0; i < 16; i++) {
+            ptrs[i] = umalloc(1024 + i * 64);
+        }
+        for (int i = 0; i < 16; i++) {
+            ufree(ptrs[i]);
+        }
+    }
+
+    //Leave a few blocks behind for main to free from another thread
+    for (int i = 0; i < 16; i++) {
+        ptrs[i] = umalloc(2048);
+    }
+    return NULL;
+}
+
+int arena_test() {
+    umemopt(UMEM_OPT_ARENAS, 4);
+    umemopt(UMEM_OPT_ARENA_SELECT, UMEM_ARENA_ROUND_ROBIN);
+    umeminit(1 << 20, BEST_FIT | UMEM_THREAD_SAFE);
+    printf("Initialized memory with Best Fit over 4 arenas in thread-safe mode.\n");
+
+    //Each worker gets its own arena, so they rarely contend for a lock
+    pthread_t threads[4];
+    void *ptrs[4][16];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, arena_worker, ptrs[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    //Frees go back to the arena that owns the block, whichever thread makes them
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 16; j++) {
+            ufree(ptrs[i][j]);
+        }
+    }
+    printf("All blocks freed by the main thread:\n");
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int growth_test() {
+    //Start with a single page and let the heap grow up to 16 MiB
+    umemopt(UMEM_OPT_HEAP_LIMIT, 16 << 20);
+    umeminit(4096, FIRST_FIT);
+    printf("Initialized a growable heap with First Fit.\n");
+    print_free_list();
+
+    //These no longer fit in the initial page, so the heap commits more memory
+    void *ptr1 = umalloc(3000);
+    void *ptr2 = umalloc(200000);
+    void *ptr3 = umalloc(5000);
+    printf("After allocations that outgrow the initial region:\n");
+    print_free_list();
+
+    //The grown memory coalesces with the original region
+    ufree(ptr2);
+    ufree(ptr1);
+    ufree(ptr3);
+    printf("After freeing everything:\n");
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int trim_test() {
+    umeminit(8 << 20, BEST_FIT);
+    printf("Initialized memory with Best Fit.\n");
+
+    //Touch a few megabytes so the pages become resident
+    void *ptrs[6];
+    for (int i = 0; i < 6; i++) {
+        ptrs[i] = umalloc(1 << 20);
+        memset(ptrs[i], 0xAB, 1 << 20);
+    }
+    for (int i = 0; i < 6; i++) {
+        ufree(ptrs[i]);
+    }
+
+    //The free span keeps its pages until it is trimmed, a second trim finds nothing new
+    printf("Purged %zu bytes.\n", umemtrim());
+    printf("Purged %zu bytes on the second trim.\n", umemtrim());
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+//Object type for slab_test
+typedef struct {
+    int id;
+    char name[20];
+} point_t;
+
+//Constructor for slab_test: runs once per object when its slab is created
+static void point_init(void *object) {
+    point_t *point = (point_t *)object;
+    point->id = -1;
+    strcpy(point->name, "unused");
+}
+
+int slab_test() {
+    umeminit(1 << 20, FIRST_FIT);
+    printf("Initialized memory with First Fit.\n");
+
+    umem_cache_t *cache = umem_cache_create("point", sizeof(point_t), 0, point_init, NULL);
+
+    //Objects come out of one slab without headers, already constructed
+    point_t *points[4];
+    for (int i = 0; i < 4; i++) {
+        points[i] = umem_cache_alloc(cache);
+        printf("Object %d at %p: id %d, name %s\n", i, (void *)points[i], points[i]->id, points[i]->name);
+        points[i]->id = i;
+    }
+
+    //A freed object is handed out again first
+    umem_cache_free(cache, points[2]);
+
+    //Test for double free exit & output to stderr
+    //umem_cache_free(cache, points[2]);
+
+    point_t *again = umem_cache_alloc(cache);
+    printf("Reallocated object at %p (was %p)\n", (void *)again, (void *)points[2]);
+
+    umem_cache_destroy(cache);
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int mmap_test() {
+    //Requests of 64 KiB and more get a mapping of their own
+    umemopt(UMEM_OPT_MMAP_THRESHOLD, 64 << 10);
+    umeminit(1 << 20, BEST_FIT);
+    printf("Initialized memory with Best Fit and a 64 KiB mmap threshold.\n");
+
+    void *small = umalloc(1000);
+    void *large = umalloc(200000);
+    printf("Small block at %p, large block at %p\n", small, large);
+    print_free_list();
+
+    //Growing the large block remaps its pages instead of copying them
+    memset(large, 'x', 200000);
+    large = urealloc(large, 8 << 20);
+    printf("Grown to 8 MiB at %p, first byte %c\n", large, ((char *)large)[0]);
+
+    //Freeing it unmaps it at once, the heap never saw it
+    ufree(large);
+    ufree(small);
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int heap_test() {
+    umeminit(1 << 20, BEST_FIT);
+    printf("Initialized memory with Best Fit.\n");
+
+    //A private heap runs its own policy inside one block of the region
+    umem_heap_t *heap = umem_heap_create(16 << 10, FIRST_FIT);
+    void *ptr1 = umem_heap_alloc(heap, 100);
+    void *ptr2 = umem_heap_alloc(heap, 200);
+    umem_heap_free(heap, ptr1);
+    printf("First Fit heap handed out %p and %p\n", ptr1, ptr2);
+    umem_heap_destroy(heap);
+
+    //A bump heap hands out memory in order and frees it all at once
+    umem_heap_t *scratch = umem_heap_create(4096, UMEM_BUMP);
+    void *first = umem_heap_alloc(scratch, 64);
+    size_t mark = umem_heap_mark(scratch);
+    void *temp = umem_heap_alloc(scratch, 1000);
+    umem_heap_rollback(scratch, mark);
+    void *again = umem_heap_alloc(scratch, 1000);
+    printf("Bump heap: first %p, rolled back %p, reused %p\n", first, temp, again);
+
+    umem_heap_reset(scratch);
+    printf("After reset the next block is %p again\n", umem_heap_alloc(scratch, 64));
+    umem_heap_destroy(scratch);
+
+    //Destroying the heaps gave their blocks back to the region
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int align_test() {
+    umeminit(1 << 20, FIRST_FIT);
+    printf("Initialized memory with First Fit.\n");
+
+    //The gap in front of an aligned block stays on the free list
+    void *small = umalloc(100);
+    void *line = umemalign(64, 100);
+    void *page = ualigned_alloc(4096, 8192);
+    printf("Cache line block at %p, page block at %p\n", line, page);
+    print_free_list();
+
+    //Aligned blocks are ordinary blocks once allocated
+    line = urealloc(line, 500);
+    ufree(page);
+    ufree(line);
+    ufree(small);
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int batch_test() {
+    umeminit(1 << 20, BEST_FIT);
+    printf("Initialized memory with Best Fit.\n");
+
+    //The whole batch is carved from one free block in a single pass
+    void *ptrs[16];
+    size_t count = umalloc_batch(48, 16, ptrs);
+    printf("Allocated %zu blocks from %p to %p\n", count, ptrs[0], ptrs[count - 1]);
+    print_free_list();
+
+    //Freed neighbours merge into one free block before it is filed
+    ufree_batch(ptrs, count);
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int sized_test() {
+    //Requests of up to 256 bytes come from headerless size classes
+    umemopt(UMEM_OPT_SIZE_CLASSES, 256);
+    umeminit(1 << 20, FIRST_FIT);
+    printf("Initialized memory with First Fit and size classes up to 256 bytes.\n");
+
+    //Neighbouring objects of a class are 48 bytes apart, with no header in between
+    void *ptr1 = umalloc(40);
+    void *ptr2 = umalloc(40);
+    void *ptr3 = umalloc(1000);
+    printf("Objects at %p and %p, regular block at %p\n", ptr1, ptr2, ptr3);
+
+    //The caller passes the size back, which picks the class without looking the address up
+    ufree_sized(ptr1, 40);
+    ufree_sized(ptr2, 40);
+    ufree_sized(ptr3, 1000);
+
+    //Test for double free exit & output to stderr, objects of a class are checked like blocks
+    //ufree(ptr1);
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int quick_bin_test() {
+    //Freed blocks of up to 256 bytes wait in quick bins instead of coalescing
+    umemopt(UMEM_OPT_QUICK_BINS, 256);
+    umeminit(4096, FIRST_FIT);
+    printf("Initialized memory with First Fit and quick bins up to 256 bytes.\n");
+
+    void *ptr1 = umalloc(100);
+    void *ptr2 = umalloc(100);
+    ufree(ptr1);
+    printf("Freed ptr1, the free list is unchanged:\n");
+    print_free_list();
+
+    //The same size comes straight back out of its bin
+    void *ptr3 = umalloc(100);
+    printf("Reallocated %p (was %p)\n", ptr3, ptr1);
+
+    //Consolidating merges the parked blocks into the free list
+    ufree(ptr2);
+    ufree(ptr3);
+    umemconsolidate();
+    print_free_list();
+    umemstats();
+
+    return 0;
+}
+
+int calloc_test() {
+    umemopt(UMEM_OPT_HEAP_LIMIT, 16 << 20);
+    umeminit(1 << 20, FIRST_FIT);
+    printf("Initialized a growable heap with First Fit.\n");
+
+    //Fresh pages of the region are known to be zero, so only the edges of the array are cleared
+    int *array = ucalloc(100000, sizeof(int));
+    printf("Zeroed array at %p, array[50000] = %d\n", (void *)array, array[50000]);
+
+    //Reused memory is dirty and gets cleared
+    memset(array, 0xff, 100000 * sizeof(int));
+    ufree(array);
+    array = ucalloc(100000, sizeof(int));
+    printf("Reused array at %p, array[50000] = %d\n", (void *)array, array[50000]);
+    ufree(array);
+
+    //Fill the region up to its end, so the free block made by growing starts at the old sentinel
+    void *hole = umalloc(1024);
+    void *tail = umalloc(64);
+    ufree(hole);
+    umem_stats_t stats;
+    umemstats_get(&stats);
+    void *rest = umalloc(stats.largest_free_block - 16);
+
+    //Grown pages are fresh, but the links of the new free block were written into them
+    unsigned char *grown = ucalloc(200000, 1);
+    size_t dirty = 0;
+    for (size_t i = 0; i < 200000; i++) {
+        dirty += grown[i] != 0;
+    }
+    printf("Array after growth at %p, %zu non-zero bytes\n", (void *)grown, dirty);
+    ufree(grown);
+    ufree(rest);
+    ufree(tail);
+
+    //n * size does not fit in a size_t
+    if (ucalloc((size_t)1 << 40, (size_t)1 << 40) == NULL) {
+        printf("Overflowing request rejected.\n");
+    }
+    umemstats();
+
+    return 0;
+}
+
+int trace_test() {
+    umeminit(1 << 20, BEST_FIT);
+    printf("Initialized memory with Best Fit.\n");
+
+    //Every call is recorded until the trace is stopped, replay it with: ./replay memory_trace.bin first
+    umemtrace("memory_trace.bin");
+    void *ptr1 = umalloc(256);
+    void *ptr2 = ucalloc(16, 32);
+    ptr1 = urealloc(ptr1, 1024);
+    ufree(ptr2);
+    ufree(ptr1);
+    umemtrace(NULL);
+    printf("Recorded 5 operations in memory_trace.bin\n");
+
+    return 0;
+}
+
+int stats_test() {
+    umeminit(1 << 20, FIRST_FIT);
+    printf("Initialized memory with First Fit.\n");
+
+    //Leave holes of every other block, so the free histogram has something to show
+    void *ptrs[16];
+    for (int i = 0; i < 16; i++) {
+        ptrs[i] = umalloc(64 << (i % 4));
+    }
+    for (int i = 0; i < 16; i += 2) {
+        ufree(ptrs[i]);
+    }
+
+    //A snapshot costs the same whatever the size of the heap, so it can be polled
+    umem_stats_t stats;
+    umemstats_get(&stats);
+    printf("%llu free blocks, largest %llu bytes, fragmentation %.2f%%\n",
+           (unsigned long long)stats.free_blocks, (unsigned long long)stats.largest_free_block, stats.fragmentation);
+    umemstats_export(stdout, UMEM_STATS_TEXT);
+    umemstats_export(stdout, UMEM_STATS_JSON);
+
+    for (int i = 1; i < 16; i += 2) {
+        ufree(ptrs[i]);
+    }
+    umemstats();
+
+    return 0;
+}
+
+int profile_test() {
+    umeminit(1 << 24, BEST_FIT);
+    printf("Initialized memory with Best Fit.\n");
+
+    //Sample one block per 64 KiB allocated on average
+    umemprofile(64 * 1024);
+
+    //The blocks of the first loop are freed, those of the second are leaked
+    for (int i = 0; i < 10000; i++) {
+        ufree(umalloc(512));
+    }
+    for (int i = 0; i < 1000; i++) {
+        umalloc(1024);
+    }
+
+    //View it with: pprof -sample_index=inuse_space ./main heap.prof (alloc_space for every allocation)
+    umemprofile_dump("heap.prof");
+    umemprofile(0);
+    printf("Wrote heap.prof\n");
+
+    return 0;
+}
+
+int init_failure_test() {
+    //Under a 1 GiB address space limit the 64 GiB reservation of a growable heap cannot be mapped,
+    //as with "ulimit -v" in front of a program running on the LD_PRELOAD shim
+    struct rlimit limit = { (rlim_t)1 << 30, (rlim_t)1 << 30 };
+    setrlimit(RLIMIT_AS, &limit);
+    umemopt(UMEM_OPT_HEAP_LIMIT, 64L << 30);
+
+    //umeminit fails instead of exiting, so the caller can fall back to the libc allocator
+    if (umeminit(1 << 20, TLSF) != 0) {
+        char *fallback = malloc(100);
+        strcpy(fallback, "libc");
+        printf("umeminit failed, the block came from %s.\n", fallback);
+        free(fallback);
+    }
+
+    //Nothing was left behind, a heap that fits can still be set up
+    umemopt(UMEM_OPT_HEAP_LIMIT, 0);
+    if (umeminit(1 << 20, TLSF) == 0) {
+        void *ptr = umalloc(100);
+        printf("Initialized a fixed heap under the same limit, block at %p\n", ptr);
+        ufree(ptr);
+    }
+
+    return 0;
+}
@@ -0,0 +1,329 @@
+//Runs unmodified programs on umem: malloc, free, calloc, realloc and the aligned and usable-size calls
+//are exported on top of it, so a binary picks them up through LD_PRELOAD.
+//
+//Build: cc -O2 -fPIC -shared -fvisibility=hidden -o libumem.so preload.c umem.c -lpthread -ldl
+//Usage: LD_PRELOAD=./libumem.so UMEM_POLICY=best program
+//
+//Settings are read from the environment when the first allocation initializes the heap:
+//  UMEM_POLICY        best, worst, first, next, buddy or tlsf, or a umeminit number (default tlsf).
+//                     Programs may start threads at any time, so thread-safe mode is always on.
+//  UMEM_REGION        Initial size of the heap in bytes (default 64 MiB)
+//  UMEM_OPTIONS       umemopt settings as option=value pairs separated by commas, e.g. "9=256,10=128".
+//                     They are applied over the defaults: one arena per CPU up to 8, a 64 GiB heap
+//                     limit, direct mappings from 256 KiB up and failures reported through errno only.
+//  UMEM_PROFILE       Mean bytes between heap profile samples, the profile is written at exit
+//  UMEM_PROFILE_FILE  Where the profile goes (default umem.prof)
+//  UMEM_STATS         text or json, writes the heap statistics to stderr at exit
+#define _GNU_SOURCE
+#include "umem.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_REGION ((size_t)64 << 20)
+#define DEFAULT_HEAP_LIMIT ((size_t)64 << 30)
+#define DEFAULT_MMAP_THRESHOLD ((size_t)256 << 10)
+#define MAX_DEFAULT_ARENAS (8)
+
+//Allocations made while the heap is set up, by the loader, dlsym or another thread that got there
+//first, are carved from a static buffer. Each block starts with its size, they are never reused.
+#define BOOTSTRAP_SIZE ((size_t)256 << 10)
+#define BOOTSTRAP_ALIGN (16)
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGN)));
+static size_t bootstrap_used = 0;
+
+//Heap states: allocations go to the bootstrap buffer until the heap is ready. If umeminit fails
+//the libc allocator takes over.
+#define HEAP_NONE (0)
+#define HEAP_STARTING (1)
+#define HEAP_READY (2)
+#define HEAP_FAILED (3)
+static int heap_state = HEAP_NONE;
+
+//The libc functions, for blocks umem did not hand out
+static void* (*libc_malloc)(size_t);
+static void (*libc_free)(void*);
+static void* (*libc_realloc)(void*, size_t);
+static int (*libc_posix_memalign)(void**, size_t, size_t);
+static size_t (*libc_usable_size)(void*);
+
+static const char* profile_file = "umem.prof";
+static int stats_format = -1;
+
+static void* bootstrap_alloc(size_t alignment, size_t size) {
+    if (alignment < BOOTSTRAP_ALIGN) {
+        alignment = BOOTSTRAP_ALIGN;
+    }
+
+    size_t used = __atomic_load_n(&bootstrap_used, __ATOMIC_RELAXED);
+    size_t start;
+    do {
+        start = (used + BOOTSTRAP_ALIGN + alignment - 1) & ~(alignment - 1);
+        if (size > BOOTSTRAP_SIZE || start > BOOTSTRAP_SIZE - size) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&bootstrap_used, &used, start + size, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    *(size_t* )(bootstrap + start - sizeof(size_t)) = size;
+    return bootstrap + start;
+}
+
+static bool bootstrap_owns(void* ptr) {
+    return (char* )ptr >= bootstrap && (char* )ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static size_t bootstrap_size(void* ptr) {
+    return *(size_t* )((char* )ptr - sizeof(size_t));
+}
+
+static int parse_policy(const char* name) {
+    static const char* names[] = { "best", "worst", "first", "next", "buddy", "tlsf" };
+
+    for (int i = 0; i < 6; i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            return i + 1;
+        }
+    }
+    return atoi(name);
+}
+
+static void heap_exit(void) {
+    if (getenv("UMEM_PROFILE") != NULL) {
+        umemprofile_dump(profile_file);
+    }
+    if (stats_format >= 0) {
+        umemstats_export(stderr, stats_format);
+    }
+}
+
+//Sets the heap up on the first allocation. Whatever the setup allocates itself, dlsym included,
+//comes from the bootstrap buffer.
+static void heap_start(void) {
+    int expected = HEAP_NONE;
+    if (!__atomic_compare_exchange_n(&heap_state, &expected, HEAP_STARTING, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    libc_malloc = dlsym(RTLD_NEXT, "malloc");
+    libc_free = dlsym(RTLD_NEXT, "free");
+    libc_realloc = dlsym(RTLD_NEXT, "realloc");
+    libc_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    libc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    umemopt(UMEM_OPT_ARENAS, cpus < 1 ? 1 : cpus > MAX_DEFAULT_ARENAS ? MAX_DEFAULT_ARENAS : cpus);
+    umemopt(UMEM_OPT_HEAP_LIMIT, (long)DEFAULT_HEAP_LIMIT);
+    umemopt(UMEM_OPT_MMAP_THRESHOLD, (long)DEFAULT_MMAP_THRESHOLD);
+    umemopt(UMEM_OPT_QUIET, 1);
+
+    const char* options = getenv("UMEM_OPTIONS");
+    while (options != NULL && *options != '\0') {
+        char* end;
+        long option = strtol(options, &end, 0);
+        if (*end != '=' || umemopt((int)option, strtol(end + 1, &end, 0)) != 0) {
+            fprintf(stderr, "Ignoring invalid UMEM_OPTIONS entry at \"%s\".\n", options);
+        }
+        options = strchr(end, ',');
+        if (options != NULL) {
+            options++;
+        }
+    }
+
+    const char* policy = getenv("UMEM_POLICY");
+    const char* region = getenv("UMEM_REGION");
+    int algorithm = policy != NULL ? parse_policy(policy) : TLSF;
+    size_t size = region != NULL ? strtoull(region, NULL, 0) : DEFAULT_REGION;
+
+    if (libc_malloc == NULL || libc_free == NULL || umeminit(size, algorithm | UMEM_THREAD_SAFE) != 0) {
+        fprintf(stderr, "umem could not be initialized, using the libc allocator.\n");
+        __atomic_store_n(&heap_state, HEAP_FAILED, __ATOMIC_RELEASE);
+        return;
+    }
+
+    const char* profile = getenv("UMEM_PROFILE");
+    if (profile != NULL) {
+        if (getenv("UMEM_PROFILE_FILE") != NULL) {
+            profile_file = getenv("UMEM_PROFILE_FILE");
+        }
+        umemprofile(strtoull(profile, NULL, 0));
+    }
+    const char* stats = getenv("UMEM_STATS");
+    if (stats != NULL) {
+        stats_format = strcasecmp(stats, "json") == 0 ? UMEM_STATS_JSON : UMEM_STATS_TEXT;
+    }
+    if (profile != NULL || stats != NULL) {
+        atexit(heap_exit);
+    }
+
+    __atomic_store_n(&heap_state, HEAP_READY, __ATOMIC_RELEASE);
+}
+
+//Returns the state allocations should follow, starting the heap if nobody has
+static int heap_ready(void) {
+    int state = __atomic_load_n(&heap_state, __ATOMIC_ACQUIRE);
+    if (state == HEAP_NONE) {
+        heap_start();
+        state = __atomic_load_n(&heap_state, __ATOMIC_ACQUIRE);
+    }
+    return state;
+}
+
+//umem is quiet about failures here, callers of malloc expect errno
+static void* checked(void* ptr) {
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void* malloc(size_t size) {
+    switch (heap_ready()) {
+        case HEAP_READY:
+            //malloc(0) hands out a unique block, umalloc rejects it
+            return checked(umalloc(size > 0 ? size : 1));
+        case HEAP_FAILED:
+            return libc_malloc(size);
+        default:
+            return checked(bootstrap_alloc(0, size));
+    }
+}
+
+EXPORT void free(void* ptr) {
+    if (ptr == NULL || bootstrap_owns(ptr)) {
+        return;
+    }
+    if (umalloc_usable_size(ptr) > 0) {
+        ufree(ptr);
+        return;
+    }
+
+    //Blocks libc handed out before any allocation came here still need the libc functions resolved
+    heap_ready();
+    if (libc_free != NULL) {
+        libc_free(ptr);
+    }
+}
+
+EXPORT void* calloc(size_t n, size_t size) {
+    if (size != 0 && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    switch (heap_ready()) {
+        case HEAP_READY:
+            return checked(n * size > 0 ? ucalloc(n, size) : ucalloc(1, 1));
+        case HEAP_FAILED: {
+            void* ptr = libc_malloc(n * size);
+            if (ptr != NULL) {
+                memset(ptr, 0, n * size);
+            }
+            return ptr;
+        }
+        default:
+            //The buffer is static and never reused, so it is still zero
+            return checked(bootstrap_alloc(0, n * size));
+    }
+}
+
+EXPORT void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    size_t old_size = umalloc_usable_size(ptr);
+    if (old_size > 0) {
+        return checked(urealloc(ptr, size));
+    }
+
+    //Bootstrap and foreign blocks move into the heap once it is there
+    if (bootstrap_owns(ptr)) {
+        old_size = bootstrap_size(ptr);
+    } else if (heap_ready() != HEAP_READY || libc_usable_size == NULL) {
+        return libc_realloc != NULL ? libc_realloc(ptr, size) : NULL;
+    } else {
+        old_size = libc_usable_size(ptr);
+    }
+
+    void* new_ptr = malloc(size);
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        free(ptr);
+    }
+    return new_ptr;
+}
+
+EXPORT int posix_memalign(void** out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void* ) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    void* ptr;
+    switch (heap_ready()) {
+        case HEAP_READY:
+            ptr = umemalign(alignment, size > 0 ? size : 1);
+            break;
+        case HEAP_FAILED:
+            return libc_posix_memalign(out, alignment, size);
+        default:
+            ptr = bootstrap_alloc(alignment, size);
+    }
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    void* ptr = NULL;
+
+    //Alignments below a pointer are met by every block
+    int error = posix_memalign(&ptr, alignment < sizeof(void* ) ? sizeof(void* ) : alignment, size);
+    if (error != 0) {
+        errno = error;
+        return NULL;
+    }
+    return ptr;
+}
+
+EXPORT void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+EXPORT void* valloc(size_t size) {
+    return aligned_alloc((size_t)getpagesize(), size);
+}
+
+EXPORT void* pvalloc(size_t size) {
+    size_t page = (size_t)getpagesize();
+    return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (bootstrap_owns(ptr)) {
+        return bootstrap_size(ptr);
+    }
+
+    size_t size = umalloc_usable_size(ptr);
+    if (size == 0 && heap_ready() != HEAP_STARTING && libc_usable_size != NULL) {
+        size = libc_usable_size(ptr);
+    }
+    return size;
+}
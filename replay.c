@@ -0,0 +1,313 @@
+//Replays a trace recorded with umemtrace against any policy and reports throughput, latency
+//percentiles and peak footprint, so policies can be compared on real traffic.
+//
+//Build: cc -O2 -o replay replay.c umem.c -lpthread
+//Usage: replay [-r region_size] [-o option=value]... [-l log_file] trace_file algorithm
+//
+//The algorithm is a umeminit policy, by number (256 added for thread-safe mode) or by name.
+//Options are passed to umemopt before umeminit, -l writes the text log visualize_memory.py reads.
+#include "umem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MAX_OPTIONS (16)
+#define FOOTPRINT_INTERVAL (256)        //Operations between footprint samples
+
+//Live blocks by their address in the trace. Open addressing with tombstones, the table has room
+//for twice the records, so it can never fill up.
+#define SLOT_EMPTY (0)
+#define SLOT_DELETED (~(uint64_t)0)
+
+typedef struct {
+    uint64_t address;               //Address in the trace
+    void* ptr;                      //Block handed out during the replay
+    size_t size;
+} slot_t;
+
+static slot_t* slots;
+static size_t slot_mask;
+
+static slot_t* slot_find(uint64_t address) {
+    size_t i = (size_t)(address * 0x9E3779B97F4A7C15ULL >> 20) & slot_mask;
+
+    while (slots[i].address != SLOT_EMPTY) {
+        if (slots[i].address == address) {
+            return &slots[i];
+        }
+        i = (i + 1) & slot_mask;
+    }
+    return NULL;
+}
+
+static void slot_insert(uint64_t address, void* ptr, size_t size) {
+    size_t i = (size_t)(address * 0x9E3779B97F4A7C15ULL >> 20) & slot_mask;
+
+    while (slots[i].address != SLOT_EMPTY && slots[i].address != SLOT_DELETED) {
+        i = (i + 1) & slot_mask;
+    }
+    slots[i].address = address;
+    slots[i].ptr = ptr;
+    slots[i].size = size;
+}
+
+//Records of different threads are interleaved in the file, the replay runs them in time order.
+//Ties keep the file order, which is the order within a thread.
+static umem_trace_record_t* records;
+
+static int compare_records(const void* a, const void* b) {
+    size_t left = *(const size_t* )a;
+    size_t right = *(const size_t* )b;
+
+    if (records[left].time != records[right].time) {
+        return records[left].time < records[right].time ? -1 : 1;
+    }
+    return (left > right) - (left < right);
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    long left = *(const long* )a;
+    long right = *(const long* )b;
+    return (left > right) - (left < right);
+}
+
+static long clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+//Resident set size in bytes, read from an open /proc/self/statm
+static size_t resident_bytes(int statm) {
+    char buffer[128];
+    unsigned long pages = 0, resident = 0;
+
+    ssize_t length = pread(statm, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    sscanf(buffer, "%lu %lu", &pages, &resident);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static int parse_algorithm(const char* name) {
+    static const char* names[] = { "best", "worst", "first", "next", "buddy", "tlsf" };
+
+    for (int i = 0; i < 6; i++) {
+        if (strncasecmp(name, names[i], strlen(names[i])) == 0) {
+            return i + 1;
+        }
+    }
+    return atoi(name);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-r region_size] [-o option=value]... [-l log_file] trace_file algorithm\n", program);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    size_t region_size = (size_t)64 << 20;
+    int option_names[MAX_OPTIONS];
+    long option_values[MAX_OPTIONS];
+    int option_count = 0;
+    FILE* log = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:o:l:")) != -1) {
+        switch (opt) {
+            case 'r':
+                region_size = strtoull(optarg, NULL, 0);
+                break;
+            case 'o':
+                if (option_count == MAX_OPTIONS ||
+                    sscanf(optarg, "%d=%li", &option_names[option_count], &option_values[option_count]) != 2) {
+                    usage(argv[0]);
+                }
+                option_count++;
+                break;
+            case 'l':
+                log = fopen(optarg, "w");
+                if (log == NULL) {
+                    perror("Failed to open log file");
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+    int algorithm = parse_algorithm(argv[optind + 1]);
+
+    //Load the whole trace up front, so reading it does not count against the allocator
+    FILE* file = fopen(argv[optind], "rb");
+    if (file == NULL) {
+        perror("Failed to open trace file");
+        return 1;
+    }
+    char magic[sizeof(UMEM_TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, UMEM_TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a umem trace.\n", argv[optind]);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t count = ((size_t)ftell(file) - sizeof(magic)) / sizeof(umem_trace_record_t);
+    fseek(file, sizeof(magic), SEEK_SET);
+
+    records = malloc(count * sizeof(umem_trace_record_t) + 1);
+    size_t* order = malloc(count * sizeof(size_t) + 1);
+    long* latencies = malloc(count * sizeof(long) + 1);
+    size_t slot_count = 1024;
+    while (slot_count < 2 * count) {
+        slot_count <<= 1;
+    }
+    slots = calloc(slot_count, sizeof(slot_t));
+    slot_mask = slot_count - 1;
+    if (records == NULL || order == NULL || latencies == NULL || slots == NULL ||
+        fread(records, sizeof(umem_trace_record_t), count, file) != count) {
+        fprintf(stderr, "Failed to read %zu records.\n", count);
+        return 1;
+    }
+    fclose(file);
+
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    qsort(order, count, sizeof(size_t), compare_records);
+
+    //Touch the bookkeeping now, the footprint is measured against the resident size at this point
+    memset(latencies, 0, count * sizeof(long));
+    memset(slots, 0, slot_count * sizeof(slot_t));
+    int statm = open("/proc/self/statm", O_RDONLY);
+    size_t baseline = resident_bytes(statm);
+    size_t peak = 0;
+
+    for (int i = 0; i < option_count; i++) {
+        if (umemopt(option_names[i], option_values[i]) != 0) {
+            return 1;
+        }
+    }
+    if (umeminit(region_size, algorithm) != 0) {
+        return 1;
+    }
+
+    size_t replayed = 0, skipped = 0, failed = 0;
+    long total_time = 0;
+
+    for (size_t n = 0; n < count; n++) {
+        umem_trace_record_t* record = &records[order[n]];
+        size_t size = (size_t)record->size;
+        slot_t* slot = NULL;
+        void* ptr = NULL;
+        long start;
+
+        //A realloc that failed when it was recorded has nothing to replay
+        if (record->op == UMEM_TRACE_REALLOC && record->address == 0 && size > 0) {
+            skipped++;
+            continue;
+        }
+
+        //Frees and reallocs need the block the trace refers to. Threads racing on one address can leave
+        //records that do not line up, those are skipped.
+        if (record->op == UMEM_TRACE_FREE || record->op == UMEM_TRACE_FREE_SIZED ||
+            (record->op == UMEM_TRACE_REALLOC && record->argument != 0)) {
+            slot = slot_find(record->op == UMEM_TRACE_REALLOC ? record->argument : record->address);
+            if (slot == NULL) {
+                skipped++;
+                continue;
+            }
+        } else if (slot_find(record->address) != NULL) {
+            skipped++;
+            continue;
+        }
+
+        switch (record->op) {
+            case UMEM_TRACE_MALLOC:
+                start = clock_ns();
+                ptr = umalloc(size);
+                break;
+            case UMEM_TRACE_CALLOC:
+                start = clock_ns();
+                ptr = ucalloc(1, size);
+                break;
+            case UMEM_TRACE_MEMALIGN:
+                start = clock_ns();
+                ptr = umemalign((size_t)record->argument, size);
+                break;
+            case UMEM_TRACE_REALLOC:
+                start = clock_ns();
+                ptr = urealloc(slot != NULL ? slot->ptr : NULL, size);
+                break;
+            case UMEM_TRACE_FREE:
+                start = clock_ns();
+                ufree(slot->ptr);
+                break;
+            case UMEM_TRACE_FREE_SIZED:
+                start = clock_ns();
+                ufree_sized(slot->ptr, size);
+                break;
+            default:
+                skipped++;
+                continue;
+        }
+        latencies[replayed] = clock_ns() - start;
+        total_time += latencies[replayed];
+        replayed++;
+
+        //The old block of a realloc is gone unless the call failed
+        if (slot != NULL && (record->op != UMEM_TRACE_REALLOC || ptr != NULL || size == 0)) {
+            if (log != NULL) {
+                fprintf(log, "FREE %p %zu\n", slot->ptr, slot->size);
+            }
+            slot->address = SLOT_DELETED;
+        }
+
+        //Blocks are filled like a program would, so the footprint counts the pages they use
+        if (record->op != UMEM_TRACE_FREE && record->op != UMEM_TRACE_FREE_SIZED && size > 0) {
+            if (ptr == NULL) {
+                failed++;
+                continue;
+            }
+            memset(ptr, 0xA5, size);
+            slot_insert(record->address, ptr, size);
+            if (log != NULL) {
+                fprintf(log, "ALLOCATE %p %zu\n", ptr, size);
+            }
+        }
+
+        if (replayed % FOOTPRINT_INTERVAL == 0) {
+            size_t resident = resident_bytes(statm);
+            if (resident > baseline && resident - baseline > peak) {
+                peak = resident - baseline;
+            }
+        }
+    }
+    size_t resident = resident_bytes(statm);
+    if (resident > baseline && resident - baseline > peak) {
+        peak = resident - baseline;
+    }
+
+    qsort(latencies, replayed, sizeof(long), compare_latencies);
+    printf("Replayed %zu of %zu operations with algorithm %d (%zu skipped, %zu failed)\n",
+           replayed, count, algorithm, skipped, failed);
+    if (replayed > 0) {
+        printf("Throughput: %.2f Mops/s\n", total_time > 0 ? replayed * 1000.0 / total_time : 0.0);
+        printf("Latency: p50 %ld ns, p90 %ld ns, p99 %ld ns, p99.9 %ld ns, max %ld ns\n",
+               latencies[replayed / 2], latencies[replayed * 9 / 10], latencies[replayed * 99 / 100],
+               latencies[replayed * 999 / 1000], latencies[replayed - 1]);
+    }
+    printf("Peak footprint: %zu KiB\n", peak >> 10);
+
+    if (log != NULL) {
+        fclose(log);
+    }
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "umem.h"
 #include <stdlib.h>
 #include <string.h>
@@ -5,508 +6,4055 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdbool.h>
-
-static void* memory_region = NULL;    //Base pointer for memory region
-static size_t total_memory = 0;       //Total size of the memory region
-static int alloc_algorithm = FIRST_FIT;  //Default allocation algorithm
-
-static size_t allocated_memory = 0;   //Track allocated memory
-static size_t free_memory = 0;        //Track free memory
-static int total_allocations = 0;     //Track total allocations
-static int total_deallocations = 0;   //Track total deallocations
-static node_t* free_list = NULL;      //Head of the free list
-static node_t* last_allocated = NULL; //Keeps track of last allocated's next node in the free list
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <execinfo.h>
+
+//Buddy allocator state
+#define BUDDY_MIN_ORDER (5)                   //Smallest buddy block is 32 bytes (fits a buddy_node_t)
+#define BUDDY_MAX_ORDER (47)                  //Largest buddy block we track (128 TiB)
+#define BUDDY_FREE 0xB0DDB0DDLL               //Magic number marking a free buddy block
+
+typedef struct __buddy_node_t {
+    block_word_t size;              //Size of the free block (always a power of two)
+    block_word_t magic;             //BUDDY_FREE while the block sits on a free list
+    struct __buddy_node_t *next;    //Next free block of the same order
+    struct __buddy_node_t *prev;    //Previous free block of the same order
+} buddy_node_t;
+
+//Block status bits stored in the low bits of the size field (sizes are always multiples of 8).
+//Allocated blocks store their usable size after the header, free blocks their full size.
+#define BLOCK_FREE (1L)                       //The block is free
+#define PREV_FREE  (2L)                       //The physically preceding block is free and ends in a footer
+#define BLOCK_PURGED (4L)                     //The pages inside the free block have been given back to the OS
+#define SIZE_FLAGS (7L)
+
+//Address index of the free list: one bit per 8-byte granule marking the start of a free block,
+//with each level above holding one bit per non-empty word of the level below
+#define FREE_MAP_GRANULE (8)
+#define FREE_MAP_LEVELS (12)
+
+//Size index for BEST_FIT and WORST_FIT: a treap keyed by (size, address) whose priorities are
+//hashed from the block address, so the free block only needs two extra links
+typedef struct __tree_node_t {
+    node_t node;                    //Free list links and size, shared with the other policies
+    struct __tree_node_t *left;     //Smaller (size, address) keys
+    struct __tree_node_t *right;    //Larger (size, address) keys
+} tree_node_t;
+
+//TLSF (two-level segregated fit) state
+#define TLSF_SL_LOG2 (4)                                  //16 second-level lists per first level
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 3)                  //Sizes below 128 bytes use a linear first level
+#define TLSF_SMALL_BLOCK ((size_t)1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (40)                                //Up to 2^46 byte blocks
+
+//Quick bins (UMEM_OPT_QUICK_BINS): freed blocks up to quick_bin_max usable bytes are parked
+//uncoalesced on a LIFO list per size and handed out again as they are. They are only merged
+//into the free structures when a search fails, when too many bytes are parked, or on demand.
+#define QUICK_BIN_LIMIT (512)                 //Largest size the option accepts
+#define QUICK_BINS (QUICK_BIN_LIMIT / 8 + 1)  //One bin per 8-byte usable size
+#define QUICK_BYTES_LIMIT ((size_t)256 << 10) //Parked bytes per arena that trigger a consolidation
+#define QUICK_MAGIC 0x0B1B0B1BLL              //Magic number of a block parked in a quick bin
+
+//An arena is an independent heap: its own slice of the region, free structures, statistics and lock
+typedef struct {
+    void* memory_region;                //Base pointer for the arena's memory
+    size_t total_memory;                //Committed size of the arena's memory
+    size_t reserved_memory;             //Size the arena may grow to
+    int alloc_algorithm;                //Allocation algorithm of the arena
+    size_t min_free_block;              //Free node plus footer, set per algorithm
+
+    size_t allocated_memory;            //Track allocated memory
+    size_t free_memory;                 //Track free memory
+    uint64_t total_allocations;         //Track total allocations
+    uint64_t total_deallocations;       //Track total deallocations
+    size_t free_blocks;                 //Blocks on the free structures
+    size_t free_histogram[UMEM_STATS_BUCKETS];        //Free blocks per power of two of their size
+    size_t free_histogram_bytes[UMEM_STATS_BUCKETS];  //Bytes in those blocks
+    node_t* free_list;                  //Head of the free list
+    node_t* last_allocated;             //Keeps track of last allocated's next node in the free list
+
+    buddy_node_t* buddy_lists[BUDDY_MAX_ORDER + 1];   //One free list per order
+    unsigned long* free_map[FREE_MAP_LEVELS];         //Address index of the free list
+    int free_map_levels;
+    size_t free_map_bytes;                            //Size of the free map mapping
+    unsigned long* slab_map;                          //One bit per CLASS_SLAB_SIZE window holding a size-class slab
+    unsigned long* zero_map;                          //One bit per base page known to hold only zeros
+    tree_node_t* size_tree;                           //Root of the size index
+
+    node_t* tlsf_lists[TLSF_FL_COUNT][TLSF_SL_COUNT]; //Segregated free lists
+    unsigned long tlsf_fl_bitmap;                     //Bit f set when any list in tlsf_lists[f] is non-empty
+    unsigned int tlsf_sl_bitmap[TLSF_FL_COUNT];       //Bit s set when tlsf_lists[f][s] is non-empty
+
+    pthread_mutex_t lock;               //Guards the arena in thread-safe mode
+    header_t* remote_frees;             //Blocks freed by other threads, pushed without the lock
+
+    header_t* quick_bins[QUICK_BINS];   //Parked blocks per usable size, linked through their payload
+    size_t quick_bytes;                 //Bytes parked in the quick bins
+    size_t quick_blocks;                //Blocks parked in the quick bins
+    bool clear_blocks;                  //Blocks carved while set are handed out zeroed (ucalloc)
+
+    size_t purged_memory;               //Free memory whose pages have been given back to the OS
+    size_t purge_floor;                 //Least dirty free memory since the last purge
+    long last_purge;                    //Time of the last purge in milliseconds
+    unsigned int purge_ticks;           //Frees since the decay clock was last read
+} arena_t;
+
+//The region is split into arena_count arenas of arena_stride bytes each, so the arena
+//owning a pointer is found with one division
+#define MAX_ARENAS (64)
+#define GROW_CHUNK ((size_t)1 << 20)    //Smallest amount an arena commits when it grows
+
+//Compact headers (UMEM_COMPACT_HEADER) hold sizes in 32 bits, so an arena stays below 4 GiB and a
+//direct mapping records its length in pages
+#ifdef UMEM_COMPACT_HEADER
+#define ARENA_SIZE_LIMIT (((size_t)1 << 32) - HUGE_PAGE_SIZE)
+#define MMAP_LENGTH_SHIFT (12)
+#else
+#define ARENA_SIZE_LIMIT (~(size_t)0)
+#define MMAP_LENGTH_SHIFT (0)
+#endif
+static char* memory_region = NULL;    //Base pointer for memory region
+static size_t arena_stride = 0;       //Size of each arena's reservation
+static size_t heap_limit = 0;         //Size the whole heap may grow to (UMEM_OPT_HEAP_LIMIT), 0 keeps it fixed
+static bool quiet = false;            //Failed requests return NULL without a message (UMEM_OPT_QUIET)
+
+//Backing of the region (UMEM_OPT_HUGE_PAGES, UMEM_OPT_PREFAULT)
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+static int huge_pages = UMEM_HUGE_NONE;
+static int prefault = UMEM_PREFAULT_NONE;
+static size_t page_size = 4096;       //Unit the region is committed and purged in
+static size_t zero_page_size = 4096;  //Unit of the zero maps, the base page even when the region uses huge pages
+
+//Direct mappings (UMEM_OPT_MMAP_THRESHOLD): requests of at least mmap_threshold bytes get a mapping
+//of their own, starting with a regular header marked by MMAP_MAGIC. Zero keeps everything in the heap.
+#define MMAP_MAGIC 0x3A9B10C5LL
+static size_t mmap_threshold = 0;
+static size_t quick_bin_max = 0;      //Largest usable size kept in the quick bins, 0 disables them
+static size_t mmap_allocated = 0;     //Usable bytes in direct mappings
+static uint64_t mmap_allocations = 0;
+static uint64_t mmap_deallocations = 0;
+
+//Purging (umemtrim): dirty free memory is handed back after purge_decay milliseconds without a purge,
+//or as soon as it exceeds purge_threshold bytes. Zero disables either rule.
+#define PURGE_CLOCK_INTERVAL (64)             //Frees between reads of the clock
+#ifdef MADV_FREE
+#define PURGE_LAZY MADV_FREE
+#else
+#define PURGE_LAZY MADV_DONTNEED
+#endif
+static long purge_decay = 0;
+static size_t purge_threshold = 0;
+static int arena_count = 1;           //Number of arenas (UMEM_OPT_ARENAS)
+static int arena_select = UMEM_ARENA_PER_CPU;  //How threads pick an arena (UMEM_OPT_ARENA_SELECT)
+static arena_t arenas[MAX_ARENAS];
+static unsigned int next_arena = 0;   //Round-robin counter
+static __thread arena_t* thread_arena = NULL;  //Arena handed to the calling thread in round-robin mode
+
+//Thread safety (UMEM_THREAD_SAFE): each arena has a lock, small blocks are cached per thread
+static bool thread_safe = false;
+
+#define TCACHE_CLASS_SIZE (16)                //Size classes are 16 bytes apart
+#define TCACHE_CLASSES (32)                   //Cached sizes go up to 512 bytes
+#define TCACHE_MAX_SIZE (TCACHE_CLASS_SIZE * TCACHE_CLASSES)
+#define TCACHE_LIMIT (32)                     //Blocks a thread keeps per class
+#define TCACHE_BATCH (16)                     //Blocks moved per refill or drain
+#define TCACHE_MAGIC 0x7CAC4EDLL              //Magic number of a block parked in a thread cache
+#define REMOTE_MAGIC 0x4E3073EDLL             //Magic number of a block waiting on a remote free queue
+
+//Cached blocks stay allocated as far as their arena is concerned. They are linked through the first
+//word after their header, and the class of a block is the largest request its usable size covers.
+typedef struct {
+    header_t* blocks[TCACHE_CLASSES];   //Cached blocks per class
+    int counts[TCACHE_CLASSES];         //Number of cached blocks per class
+    long allocations;                   //Cache hits not yet added to total_allocations
+    long deallocations;                 //Cache frees not yet added to total_deallocations
+    bool registered;                    //The exit destructor has been set up for this thread
+    bool destroyed;                     //The exit destructor has run, later calls go to the heap
+} tcache_t;
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+//Object caches (umem_cache_create): fixed-size objects are packed without headers into slabs carved
+//from the heap. A slab is aligned to its power-of-two size, so masking an object's address finds it.
+#define SLAB_MIN_OBJECTS (8)                  //Slabs grow until they hold at least this many objects
+#define SLAB_MAX_OBJECTS (65535)              //Object indexes are 16 bits
+#define SLAB_BITS (8 * sizeof(unsigned long)) //Objects tracked per word of the in_use bitmap
+#define CACHE_NAME_LENGTH (32)
+
+typedef struct __slab_t {
+    struct umem_cache* cache;       //Cache the slab belongs to
+    struct __slab_t* next;          //Next slab on the same list of the cache
+    struct __slab_t* prev;          //Previous slab on the same list of the cache
+    void* block;                    //Heap block holding the slab
+    size_t bytes;                   //Usable bytes of that block
+    char* objects;                  //First object of the slab
+    unsigned long* in_use;          //One bit per object handed out, a free of a clear bit is a double free
+    int free_count;                 //Number of indexes on free_stack
+    unsigned short free_stack[];    //Indexes of the free objects, kept outside the objects so they stay constructed
+} slab_t;
+
+struct umem_cache {
+    char name[CACHE_NAME_LENGTH];
+    size_t object_size;             //Object size rounded up to the alignment
+    size_t align;                   //Alignment of the objects
+    size_t slab_size;               //Size and alignment of each slab
+    int objects_per_slab;
+    void (*constructor)(void* object);
+    void (*destructor)(void* object);
+    slab_t* partial_slabs;          //Slabs with free objects
+    slab_t* full_slabs;             //Slabs without free objects
+    slab_t* empty_slab;             //One completely free slab kept to avoid thrashing
+    bool size_class;                //Slabs are marked in the slab map of their arena
+    arena_t* arena;                 //Arena the slabs come from, NULL for the caller's
+    uint64_t allocations;           //Objects handed out, reported by the stats in place of the slabs
+    uint64_t deallocations;
+    uint64_t slabs_created;         //Heap blocks taken for slabs, taken back out of the heap's counts
+    int slabs;                      //Slabs currently held
+    size_t slab_bytes;              //Usable bytes of the blocks of those slabs
+    pthread_mutex_t lock;           //Guards the cache in thread-safe mode
+    struct umem_cache* next;        //Next cache made by umem_cache_create
+};
+
+//Caches made by umem_cache_create, kept so a fork can take their locks
+static struct umem_cache* user_caches = NULL;
+static pthread_mutex_t user_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t retired_objects = 0;    //Objects of destroyed caches, all counted as freed, less their slabs
+
+//Size classes (UMEM_OPT_SIZE_CLASSES): requests up to size_class_limit bytes are served headerless
+//from one object cache per 16-byte class and arena, so threads of different arenas never share a
+//cache lock. Their slabs all have the same size and are marked in a
+//bitmap per arena, so ufree finds them from the address alone.
+#define SIZE_CLASS_STEP (16)
+#define SIZE_CLASS_LIMIT (1024)                       //Largest size the option accepts
+#define SIZE_CLASSES (SIZE_CLASS_LIMIT / SIZE_CLASS_STEP)
+#define CLASS_SLAB_SIZE ((size_t)64 << 10)
+static size_t size_class_limit = 0;
+static struct umem_cache class_caches[MAX_ARENAS][SIZE_CLASSES];
+
+//Heap handles (umem_heap_create): private heaps carved from the region as one block, so destroying
+//one is a single ufree. A bump heap only moves an offset and frees everything at once.
+struct umem_heap {
+    int algorithm;                  //Allocation policy, or UMEM_BUMP
+    char* base;                     //Memory of the heap
+    size_t size;
+    size_t offset;                  //Bump pointer of a bump heap
+    arena_t* arena;                 //Free structures of a heap running one of the policies
+};
+
+//Tracing (umemtrace): every thread writes compact records into a ring of its own, and a flusher
+//thread appends them to the trace file in the background. A ring that is half full wakes the
+//flusher early, a full one drops records instead of waiting, so tracing never blocks the caller.
+#define TRACE_RING_RECORDS (16384)            //Records per thread, a power of two
+#define TRACE_FLUSH_INTERVAL (10)             //Milliseconds between flushes
+
+typedef struct __trace_ring_t {
+    umem_trace_record_t records[TRACE_RING_RECORDS];
+    unsigned long head;                 //Records written by the owning thread
+    unsigned long tail;                 //Records written out by the flusher
+    struct __trace_ring_t* next;        //Every ring ever created, newest first
+} trace_ring_t;
+
+static int tracing = 0;               //Set while a trace is recorded
+static FILE* trace_file = NULL;
+static pthread_t trace_flusher;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_wakeup = PTHREAD_COND_INITIALIZER;
+static long trace_start = 0;          //Clock reading the record times are relative to, in nanoseconds
+static unsigned long trace_dropped = 0;
+static trace_ring_t* trace_rings = NULL;
+static __thread trace_ring_t* thread_ring = NULL;
+
+//Heap profiling (umemprofile): each thread counts down a random number of allocated bytes, drawn
+//so that samples form a Poisson process of mean profile_rate bytes, and the allocation that crosses
+//zero has its stack recorded. Sampled blocks are kept until they are freed. A counter per table home
+//slot tells a free that its block cannot be sampled with a single load, so only the frees of sampled
+//blocks, and the rare collisions, take the profile lock.
+#define PROFILE_DEPTH (32)                    //Frames kept per stack
+#define PROFILE_STACK_BITS (13)
+#define PROFILE_STACKS (1 << PROFILE_STACK_BITS)
+#define PROFILE_BLOCK_BITS (16)
+#define PROFILE_BLOCKS (1 << PROFILE_BLOCK_BITS)
+
+typedef struct {
+    uint64_t hash;                      //Hash of the frames, 0 marks an unused entry
+    int depth;
+    void* frames[PROFILE_DEPTH];
+    uint64_t live_count;                //Sampled blocks of the stack that are still allocated
+    uint64_t live_bytes;
+    uint64_t alloc_count;               //Every block ever sampled at the stack
+    uint64_t alloc_bytes;
+} profile_stack_t;
+
+typedef struct {
+    void* ptr;                          //NULL marks an unused entry
+    size_t size;
+    profile_stack_t* stack;
+} profile_block_t;
+
+static int profiling = 0;             //Set once the profile tables are mapped
+static size_t profile_rate = 0;       //Mean bytes between samples, 0 stops sampling
+static size_t profile_last_rate = 0;  //Rate the samples were taken at, for scaling them back up
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_stack_t* profile_stacks = NULL;
+static profile_block_t* profile_blocks = NULL;
+static unsigned short* profile_filter = NULL;  //Sampled blocks per home slot of profile_blocks
+static size_t profile_stack_count = 0;
+static size_t profile_block_count = 0;
+static unsigned long profile_dropped = 0;
+static __thread long profile_countdown = 0;    //Bytes the thread allocates before its next sample
+static __thread uint64_t profile_random = 0;   //State of the thread's generator, 0 until seeded
+static __thread bool profile_busy = false;     //The thread is inside the profiler
 
 //Function declarations
-void coalesce(node_t* new_free_node);
-node_t* first_fit(size_t allocation_size, node_t** selected_prev);
-node_t* best_fit(size_t allocation_size, node_t** selected_prev);
-node_t* worst_fit(size_t allocation_size, node_t** selected_prev);
-node_t* next_fit(size_t allocation_size, node_t** selected_prev);
-double calculate_fragmentation(void);
+void coalesce(arena_t* arena, node_t* new_free_node);
+node_t* first_fit(arena_t* arena, size_t allocation_size);
+node_t* best_fit(arena_t* arena, size_t allocation_size);
+node_t* worst_fit(arena_t* arena, size_t allocation_size);
+node_t* next_fit(arena_t* arena, size_t allocation_size);
+node_t* tlsf_find(arena_t* arena, size_t allocation_size);
+double histogram_fragmentation(const size_t* bytes, size_t largest, size_t free_memory);
+void buddy_init(arena_t* arena);
+size_t buddy_block_bytes(size_t allocation_size, size_t lead);
+void* buddy_alloc(arena_t* arena, size_t allocation_size, size_t lead);
+void buddy_free(arena_t* arena, header_t* header);
+void buddy_carve(arena_t* arena, size_t offset, size_t end);
+void* relocate_block(arena_t* arena, void* ptr, size_t current_size, size_t size);
+void* region_alloc(size_t size);
+void region_free(void* ptr);
+void* region_realloc(void* ptr, size_t size);
+void* region_calloc(size_t n, size_t size);
+int arena_init(arena_t* arena, void* base, size_t size, size_t reserved, int algorithm);
+int arena_grow(arena_t* arena, size_t allocation_size);
+node_t* find_free_block(arena_t* arena, size_t allocation_size);
+arena_t* select_arena(void);
+arena_t* arena_of(void* ptr);
+void* arena_alloc(arena_t* arena, size_t size, size_t alignment);
+void remote_free(arena_t* arena, header_t* header);
+void remote_drain(arena_t* arena);
+void* mmap_alloc(size_t size, size_t alignment);
+void mmap_free(header_t* header);
+void* mmap_realloc(header_t* header, size_t size);
+size_t arena_trim(arena_t* arena, int advice);
+void purge_check(arena_t* arena);
+void* heap_alloc(arena_t* arena, size_t size);
+void* heap_alloc_aligned(arena_t* arena, size_t size, size_t alignment, size_t offset);
+void heap_free(arena_t* arena, void* ptr);
+void release_block(arena_t* arena, header_t* header);
+bool arena_consolidate(arena_t* arena);
+size_t heap_alloc_batch(arena_t* arena, size_t size, size_t count, void** out);
+void heap_free_batch(arena_t* arena, void** ptrs, size_t count);
+void* heap_realloc(arena_t* arena, void* ptr, size_t size);
+void* tcache_alloc(size_t size);
+bool tcache_free(header_t* header);
+int free_map_init(arena_t* arena);
+void arena_format(arena_t* arena);
+void arena_reset(arena_t* arena);
+void free_block_insert(arena_t* arena, node_t* block);
+void free_block_remove(arena_t* arena, node_t* block);
+void* carve_block(arena_t* arena, node_t* block, size_t allocation_size);
+void cache_init(umem_cache_t* cache, const char* name, size_t size, size_t align, size_t min_slab);
+void carve_run(arena_t* arena, node_t* block, size_t allocation_size, size_t count, void** out);
+void for_each_free_block(arena_t* arena, void (*visit)(void* block, size_t size, void* arg), void* arg);
+void zero_map_set(arena_t* arena, char* start, char* end);
+void zero_map_clear(arena_t* arena, char* start, char* end);
+void clear_payload(arena_t* arena, header_t* header, size_t block_size);
 
 //Debugger function
 void print_free_list();
 
-//For my image maker
-//void log_memory_operation(const char* operation, void* address, size_t size);
+void trace_event(int op, void* ptr, size_t argument, size_t size);
+void profile_event(int op, void* ptr, size_t argument, size_t size, void* caller);
 
-int umeminit(size_t sizeOfRegion, int allocationAlgo) {
-    int pageSize = getpagesize();
+//Size stored in a block's size field with the status bits stripped
+static size_t size_field(void* block) {
+    return (size_t)(*(block_word_t* )block & ~SIZE_FLAGS);
+}
+
+//Keeps the free block count and size histogram of an arena up to date as blocks are filed and
+//taken off the free structures, so the statistics never have to walk them
+static void free_stats_add(arena_t* arena, size_t size) {
+    int bucket = 63 - __builtin_clzl(size);
+    arena->free_blocks++;
+    arena->free_histogram[bucket]++;
+    arena->free_histogram_bytes[bucket] += size;
+}
+
+static void free_stats_remove(arena_t* arena, size_t size) {
+    int bucket = 63 - __builtin_clzl(size);
+    arena->free_blocks--;
+    arena->free_histogram[bucket]--;
+    arena->free_histogram_bytes[bucket] -= size;
+}
+
+//Writes the footer of a free block so the block after it can find its start
+static void write_footer(void* block, size_t size) {
+    *(long* )((char* )block + size - sizeof(long)) = (long)size;
+}
+
+//Sets or clears PREV_FREE on a block. Threads read the headers of their cached blocks
+//without the heap lock, so in thread-safe mode the update is atomic.
+static void set_prev_free(void* block, bool prev_free) {
+    block_word_t* size = (block_word_t* )block;
+
+    if (thread_safe) {
+        if (prev_free) {
+            __atomic_fetch_or(size, PREV_FREE, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(size, ~PREV_FREE, __ATOMIC_RELAXED);
+        }
+    } else if (prev_free) {
+        *size |= PREV_FREE;
+    } else {
+        *size &= ~PREV_FREE;
+    }
+}
+
+//Sizes the size classes serve, whichever call asks for them, unless a direct mapping takes them first
+static bool class_sized(size_t size) {
+    return size > 0 && size <= size_class_limit && (mmap_threshold == 0 || size < mmap_threshold);
+}
+
+//Cache of the class holding size in the calling thread's arena
+static umem_cache_t* class_cache(size_t size) {
+    return &class_caches[select_arena() - arenas][(size - 1) / SIZE_CLASS_STEP];
+}
+
+//Returns the size-class slab holding ptr, or NULL for a regular block. Only the bitmap of the
+//arena is read, never the memory around ptr.
+static slab_t* class_slab_of(arena_t* arena, void* ptr) {
+    char* base = (char* )((uintptr_t)ptr & ~(CLASS_SLAB_SIZE - 1));
+    if (arena->slab_map == NULL || base < (char* )arena->memory_region) {
+        return NULL;
+    }
+
+    size_t index = (size_t)(base - (char* )arena->memory_region) / CLASS_SLAB_SIZE;
+    unsigned long word = __atomic_load_n(&arena->slab_map[index / 64], __ATOMIC_RELAXED);
+    if ((word & (1UL << (index % 64))) == 0) {
+        return NULL;
+    }
+    return (slab_t* )(base + sizeof(header_t));
+}
+
+//Marks or unmarks the window of a size-class slab. Caches of different classes share words of
+//the bitmap, so the update is atomic.
+static void class_slab_mark(char* base, bool used) {
+    arena_t* arena = arena_of(base);
+    size_t index = (size_t)(base - (char* )arena->memory_region) / CLASS_SLAB_SIZE;
+
+    if (used) {
+        __atomic_fetch_or(&arena->slab_map[index / 64], 1UL << (index % 64), __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&arena->slab_map[index / 64], ~(1UL << (index % 64)), __ATOMIC_RELAXED);
+    }
+}
+
+//Marks the pages lying wholly inside [start, end) as holding only zeros: memory the arena has
+//never written to, or pages dropped with MADV_DONTNEED. Called with the arena lock held.
+void zero_map_set(arena_t* arena, char* start, char* end) {
+    if (arena->zero_map == NULL || end <= start) {
+        return;
+    }
+
+    char* base = (char* )arena->memory_region;
+    size_t first = ((size_t)(start - base) + zero_page_size - 1) / zero_page_size;
+    size_t last = (size_t)(end - base) / zero_page_size;
+    for (size_t i = first; i < last; i++) {
+        arena->zero_map[i / 64] |= 1UL << (i % 64);
+    }
+}
+
+//Forgets the pages overlapping [start, end), they are about to be written to
+void zero_map_clear(arena_t* arena, char* start, char* end) {
+    if (arena->zero_map == NULL || end <= start) {
+        return;
+    }
+
+    char* base = (char* )arena->memory_region;
+    size_t first = (size_t)(start - base) / zero_page_size;
+    size_t last = (size_t)(end - 1 - base) / zero_page_size;
+    for (size_t i = first; i <= last; i++) {
+        arena->zero_map[i / 64] &= ~(1UL << (i % 64));
+    }
+}
+
+//Zeroes the payload of a block about to be handed out, skipping the pages known to be zero.
+//Runs of dirty pages are cleared with one memset each.
+void clear_payload(arena_t* arena, header_t* header, size_t block_size) {
+    char* payload = (char* )(header + 1);
+    char* end = (char* )header + block_size;
+
+    if (arena->zero_map == NULL) {
+        memset(payload, 0, (size_t)(end - payload));
+        return;
+    }
+
+    char* base = (char* )arena->memory_region;
+    char* dirty = payload;
+    size_t first = (size_t)(payload - base) / zero_page_size;
+    size_t last = (size_t)(end - 1 - base) / zero_page_size;
+    for (size_t i = first; i <= last; i++) {
+        if ((arena->zero_map[i / 64] & (1UL << (i % 64))) == 0) {
+            continue;
+        }
+
+        char* page = base + i * zero_page_size;
+        if (page > dirty) {
+            memset(dirty, 0, (size_t)(page - dirty));
+        }
+        dirty = page + zero_page_size;
+    }
+    if (end > dirty) {
+        memset(dirty, 0, (size_t)(end - dirty));
+    }
+}
+
+//Explains why a request returned NULL, callers standing in for malloc only want the NULL
+static void report_failure(const char* message) {
+    if (!quiet) {
+        fprintf(stderr, "%s\n", message);
+    }
+}
+
+int umemopt(int option, long value) {
+    //Arena layout is fixed once the region is mapped
+    if (memory_region != NULL) {
+        fprintf(stderr, "Options must be set before umeminit.\n");
+        return -1;
+    }
+
+    switch (option) {
+        case UMEM_OPT_ARENAS:
+            if (value < 1 || value > MAX_ARENAS) {
+                return -1;
+            }
+            arena_count = (int)value;
+            return 0;
+        case UMEM_OPT_ARENA_SELECT:
+            if (value != UMEM_ARENA_PER_CPU && value != UMEM_ARENA_ROUND_ROBIN) {
+                return -1;
+            }
+            arena_select = (int)value;
+            return 0;
+        case UMEM_OPT_HEAP_LIMIT:
+            if (value < 0) {
+                return -1;
+            }
+            heap_limit = (size_t)value;
+            return 0;
+        case UMEM_OPT_PURGE_DECAY:
+            if (value < 0) {
+                return -1;
+            }
+            purge_decay = value;
+            return 0;
+        case UMEM_OPT_HUGE_PAGES:
+            if (value != UMEM_HUGE_NONE && value != UMEM_HUGE_TRANSPARENT && value != UMEM_HUGE_TLB) {
+                return -1;
+            }
+            huge_pages = (int)value;
+            return 0;
+        case UMEM_OPT_PREFAULT:
+            if (value != UMEM_PREFAULT_NONE && value != UMEM_PREFAULT_POPULATE && value != UMEM_PREFAULT_LOCK) {
+                return -1;
+            }
+            prefault = (int)value;
+            return 0;
+        case UMEM_OPT_MMAP_THRESHOLD:
+            if (value < 0) {
+                return -1;
+            }
+            mmap_threshold = (size_t)value;
+            return 0;
+        case UMEM_OPT_PURGE_THRESHOLD:
+            if (value < 0) {
+                return -1;
+            }
+            purge_threshold = (size_t)value;
+            return 0;
+        case UMEM_OPT_QUICK_BINS:
+            if (value < 0 || value > QUICK_BIN_LIMIT) {
+                return -1;
+            }
+            quick_bin_max = (size_t)value;
+            return 0;
+        case UMEM_OPT_SIZE_CLASSES:
+            if (value < 0 || value > SIZE_CLASS_LIMIT) {
+                return -1;
+            }
+            size_class_limit = ((size_t)value + SIZE_CLASS_STEP - 1) & ~(size_t)(SIZE_CLASS_STEP - 1);
+            return 0;
+        case UMEM_OPT_QUIET:
+            if (value != 0 && value != 1) {
+                return -1;
+            }
+            quiet = value != 0;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+//Maps the region on huge pages. MAP_HUGETLB needs pages reserved by the administrator, so it falls
+//back to transparent huge pages, which only back ranges aligned to the huge page size. The huge TLB
+//mapping claims its pages up front, as touching an unbacked huge page raises SIGBUS.
+static void* map_huge_region(size_t size, int protection) {
+    if (huge_pages == UMEM_HUGE_TLB) {
+        void* region = mmap(NULL, size, protection, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+            return region;
+        }
+        huge_pages = UMEM_HUGE_TRANSPARENT;
+    }
+
+    //Map one huge page more than needed and cut the mapping down to an aligned range
+    char* region = mmap(NULL, size + HUGE_PAGE_SIZE, protection, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    size_t head = (HUGE_PAGE_SIZE - (uintptr_t)region % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+    if (head > 0) {
+        munmap(region, head);
+    }
+    munmap(region + head + size, HUGE_PAGE_SIZE - head);
+    region += head;
+
+    madvise(region, size, MADV_HUGEPAGE);
+    return region;
+}
+
+//Faults in committed memory up front so the request path does not pay for it (UMEM_OPT_PREFAULT).
+//MADV_POPULATE_WRITE is MAP_POPULATE for a range, so it also covers memory committed when an arena
+//grows. Locking falls back to populating when RLIMIT_MEMLOCK is too low.
+static void prefault_range(void* start, size_t length) {
+    if (prefault == UMEM_PREFAULT_NONE || (prefault == UMEM_PREFAULT_LOCK && mlock(start, length) == 0)) {
+        return;
+    }
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, length, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+
+    //Older kernels: touch every page, the memory is still zero so the writes change nothing
+    for (size_t offset = 0; offset < length; offset += getpagesize()) {
+        ((volatile char* )start)[offset] = 0;
+    }
+}
+
+//Fork handlers: the child only keeps the thread that forked, so a lock held by any other thread would
+//never be released there. Every lock is taken before the fork, outermost first: the trace flusher and
+//the profile dump allocate while holding theirs, and caches carve their slabs under the arena locks.
+static void fork_prepare(void) {
+    pthread_mutex_lock(&trace_lock);
+    pthread_mutex_lock(&profile_lock);
+    pthread_mutex_lock(&user_caches_lock);
+    for (struct umem_cache* cache = user_caches; cache != NULL; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+    }
+    for (int a = 0; a < arena_count; a++) {
+        for (size_t i = 0; i < size_class_limit / SIZE_CLASS_STEP; i++) {
+            pthread_mutex_lock(&class_caches[a][i].lock);
+        }
+    }
+    for (int i = 0; i < arena_count; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+static void fork_parent(void) {
+    for (int i = arena_count - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    for (int a = arena_count - 1; a >= 0; a--) {
+        for (size_t i = size_class_limit / SIZE_CLASS_STEP; i > 0; i--) {
+            pthread_mutex_unlock(&class_caches[a][i - 1].lock);
+        }
+    }
+    for (struct umem_cache* cache = user_caches; cache != NULL; cache = cache->next) {
+        pthread_mutex_unlock(&cache->lock);
+    }
+    pthread_mutex_unlock(&user_caches_lock);
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+//The child's locks were taken by a thread it does not have, so they are set up afresh
+static void fork_child(void) {
+    for (int i = 0; i < arena_count; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+    for (int a = 0; a < arena_count; a++) {
+        for (size_t i = 0; i < size_class_limit / SIZE_CLASS_STEP; i++) {
+            pthread_mutex_init(&class_caches[a][i].lock, NULL);
+        }
+    }
+    for (struct umem_cache* cache = user_caches; cache != NULL; cache = cache->next) {
+        pthread_mutex_init(&cache->lock, NULL);
+    }
+    pthread_mutex_init(&user_caches_lock, NULL);
+    pthread_mutex_init(&profile_lock, NULL);
+    pthread_mutex_init(&trace_lock, NULL);
+
+    //The flusher stayed in the parent, so the child records nothing. Its copy of the trace file is
+    //left alone, closing it would write the parent's buffered records a second time.
+    pthread_cond_init(&trace_wakeup, NULL);
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+    trace_file = NULL;
+}
 
-    //Round up sizeOfRegion to the nearest multiple of pageSize
-    sizeOfRegion = ((sizeOfRegion + pageSize - 1) / pageSize) * pageSize;
+//Undoes a umeminit that failed part way: the maps of every arena set up so far and the region itself
+static void region_release(void* region, size_t size) {
+    for (int i = 0; i < arena_count; i++) {
+        arena_t* arena = &arenas[i];
+        if (arena->free_map_bytes > 0) {
+            munmap(arena->free_map[0], arena->free_map_bytes);
+        }
+        if (arena->slab_map != NULL) {
+            munmap(arena->slab_map, (arena_stride / CLASS_SLAB_SIZE + 1 + 63) / 64 * sizeof(unsigned long));
+        }
+        if (arena->zero_map != NULL) {
+            munmap(arena->zero_map, (arena_stride / zero_page_size + 63) / 64 * sizeof(unsigned long));
+        }
+        memset(arena, 0, sizeof(arena_t));
+    }
+    munmap(region, size);
+}
 
+int umeminit(size_t sizeOfRegion, int allocationAlgo) {
     //Check if memory region is already initialized
     if (memory_region != NULL) {
         fprintf(stderr, "Memory region is already initialized.\n");
         return -1;
     }
 
-    //Open /dev/zero for mmap
-    int fd = open("/dev/zero", O_RDWR);
-    if (fd == -1) {
-        perror("Failed to open /dev/zero");
-        return -1;
+    //Huge pages are committed and purged whole, so arenas are sized in huge pages
+    zero_page_size = (size_t)getpagesize();
+    page_size = huge_pages != UMEM_HUGE_NONE ? HUGE_PAGE_SIZE : zero_page_size;
+    size_t pageSize = page_size;
+
+    //Every arena gets an equal, page-aligned share of the region
+    size_t arena_size = (sizeOfRegion + arena_count - 1) / arena_count;
+    arena_size = ((arena_size + pageSize - 1) / pageSize) * pageSize;
+    if (arena_size > ARENA_SIZE_LIMIT) {
+        fprintf(stderr, "Memory region is too large for compact headers, use more arenas.\n");
+        return -1;
+    }
+
+    //A growable heap reserves address space for its limit and only commits the initial share
+    size_t arena_limit = (heap_limit + arena_count - 1) / arena_count;
+    arena_limit = ((arena_limit + pageSize - 1) / pageSize) * pageSize;
+    if (arena_limit > ARENA_SIZE_LIMIT) {
+        arena_limit = ARENA_SIZE_LIMIT;
+    }
+    arena_stride = arena_limit > arena_size ? arena_limit : arena_size;
+    sizeOfRegion = arena_stride * arena_count;
+    int protection = arena_stride > arena_size ? PROT_NONE : PROT_READ | PROT_WRITE;
+
+    void* region;
+    if (huge_pages != UMEM_HUGE_NONE) {
+        region = map_huge_region(sizeOfRegion, protection);
+    } else {
+        //Open /dev/zero for mmap
+        int fd = open("/dev/zero", O_RDWR);
+        if (fd == -1) {
+            perror("Failed to open /dev/zero");
+            return -1;
+        }
+
+        //Map memory from /dev/zero to simulate a contiguous memory region
+        region = mmap(NULL, sizeOfRegion, protection, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+
+        //Close /dev/zero since it’s no longer needed
+        close(fd);
+    }
+
+    //The caller may have somewhere else to go, the shim falls back to the libc allocator
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    thread_safe = (allocationAlgo & UMEM_THREAD_SAFE) != 0;
+
+    for (int i = 0; i < arena_count; i++) {
+        char* base = (char* )region + i * arena_stride;
+
+        if (protection == PROT_NONE && mprotect(base, arena_size, PROT_READ | PROT_WRITE) != 0) {
+            region_release(region, sizeOfRegion);
+            return -1;
+        }
+        prefault_range(base, arena_size);
+
+        if (arena_init(&arenas[i], base, arena_size, arena_stride, allocationAlgo & UMEM_ALGORITHM_MASK) != 0) {
+            region_release(region, sizeOfRegion);
+            return -1;
+        }
+
+        //The slab map covers the whole reservation, so grown memory is covered too
+        if (size_class_limit > 0) {
+            size_t words = (arena_stride / CLASS_SLAB_SIZE + 1 + 63) / 64;
+            arenas[i].slab_map = mmap(NULL, words * sizeof(unsigned long), PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (arenas[i].slab_map == MAP_FAILED) {
+                arenas[i].slab_map = NULL;
+                region_release(region, sizeOfRegion);
+                return -1;
+            }
+        }
+
+        //The region is fresh, only the pages holding the first free node, its footer and the
+        //sentinel have been written to
+        if (arenas[i].alloc_algorithm != BUDDY) {
+            size_t words = (arena_stride / zero_page_size + 63) / 64;
+            arenas[i].zero_map = mmap(NULL, words * sizeof(unsigned long), PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (arenas[i].zero_map == MAP_FAILED) {
+                arenas[i].zero_map = NULL;
+                region_release(region, sizeOfRegion);
+                return -1;
+            }
+            zero_map_set(&arenas[i], base + arenas[i].min_free_block,
+                         base + arena_size - sizeof(header_t) - sizeof(long));
+        }
+    }
+    memory_region = region;
+
+    for (int a = 0; a < arena_count; a++) {
+        for (size_t i = 0; i < size_class_limit / SIZE_CLASS_STEP; i++) {
+            char name[CACHE_NAME_LENGTH];
+            snprintf(name, sizeof(name), "size-%zu", (i + 1) * SIZE_CLASS_STEP);
+            cache_init(&class_caches[a][i], name, (i + 1) * SIZE_CLASS_STEP, SIZE_CLASS_STEP, CLASS_SLAB_SIZE);
+            class_caches[a][i].size_class = true;
+            class_caches[a][i].arena = &arenas[a];
+        }
+    }
+
+    //The region can only be set up once, so the handlers are registered once
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+    return 0;  //Success
+}
+
+//Sets up an arena over a page-aligned range of memory, of which the first size bytes are committed
+int arena_init(arena_t* arena, void* base, size_t size, size_t reserved, int algorithm) {
+    //Update memory statistics
+    memset(arena, 0, sizeof(arena_t));
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->memory_region = base;
+    arena->total_memory = size;
+    arena->reserved_memory = reserved;
+    arena->alloc_algorithm = algorithm;
+
+    //The address-ordered free list needs its index before the first block is filed
+    if (algorithm != BUDDY && algorithm != TLSF && free_map_init(arena) != 0) {
+        return -1;
+    }
+
+    arena_format(arena);
+    return 0;
+}
+
+//Files the committed memory of an arena with empty free structures as a single free block
+void arena_format(arena_t* arena) {
+    arena->free_memory = arena->total_memory;
+    arena->min_free_block = sizeof(node_t) + sizeof(long);
+
+    //Free blocks of the tree-indexed policies also carry the tree links
+    if (arena->alloc_algorithm == BEST_FIT || arena->alloc_algorithm == WORST_FIT) {
+        arena->min_free_block = sizeof(tree_node_t) + sizeof(long);
+    }
+
+    //The buddy allocator carves the region into its own per-order lists
+    if (arena->alloc_algorithm == BUDDY) {
+        buddy_init(arena);
+        return;
+    }
+
+    //The last header of the region is an allocated sentinel that stops coalescing
+    size_t block_size = arena->total_memory - sizeof(header_t);
+    header_t* sentinel = (header_t* )((char* )arena->memory_region + block_size);
+    sentinel->size = PREV_FREE;
+    sentinel->magic = MAGIC;
+    arena->free_memory -= sizeof(header_t);
+
+    //Initialize the free list with the full block (including header space)
+    node_t* initial_free_block = (node_t* )arena->memory_region;  //Start of free list at beginning of memory region
+    initial_free_block->size = block_size | BLOCK_FREE;  //Full region is free initially (header overhead will be accounted for during allocation)
+    write_footer(initial_free_block, block_size);
+    free_block_insert(arena, initial_free_block);
+}
+
+//Commits more of an arena's reservation so that a block of allocation_size bytes fits.
+//The new memory joins the free block at the old end of the arena, if there is one.
+int arena_grow(arena_t* arena, size_t allocation_size) {
+    size_t pageSize = page_size;
+    size_t old_size = arena->total_memory;
+    size_t new_size;
+
+    if (allocation_size > arena->reserved_memory) {
+        return -1;
+    }
+
+    //A buddy block must be aligned to its size, everything else only needs room past the sentinel
+    if (arena->alloc_algorithm == BUDDY) {
+        size_t block_size = (size_t)1 << BUDDY_MIN_ORDER;
+        while (block_size < allocation_size) {
+            block_size <<= 1;
+        }
+        new_size = ((old_size + block_size - 1) & ~(block_size - 1)) + block_size;
+    } else {
+        new_size = old_size + allocation_size + sizeof(header_t);
+    }
+
+    if (new_size < old_size + GROW_CHUNK) {
+        new_size = old_size + GROW_CHUNK;
+    }
+    new_size = ((new_size + pageSize - 1) / pageSize) * pageSize;
+    if (new_size > arena->reserved_memory) {
+        new_size = arena->reserved_memory;
+    }
+    if (new_size <= old_size ||
+        mprotect((char* )arena->memory_region + old_size, new_size - old_size, PROT_READ | PROT_WRITE) != 0) {
+        return -1;
+    }
+    prefault_range((char* )arena->memory_region + old_size, new_size - old_size);
+
+    arena->free_memory += new_size - old_size;
+
+    if (arena->alloc_algorithm == BUDDY) {
+        buddy_carve(arena, old_size, new_size);
+        return 0;
+    }
+
+    //The old sentinel becomes the header of the new free block and a new sentinel closes the arena
+    node_t* block = (node_t* )((char* )arena->memory_region + old_size - sizeof(header_t));
+    header_t* sentinel = (header_t* )((char* )arena->memory_region + new_size - sizeof(header_t));
+    sentinel->size = 0;
+    sentinel->magic = MAGIC;
+    arena->total_memory = new_size;
+
+    //Committed memory is fresh up to the footer and sentinel at its end. The pages are marked before
+    //the block is filed, so the pages its node and footer land in are cleared again.
+    zero_map_set(arena, (char* )arena->memory_region + old_size, (char* )sentinel - sizeof(long));
+
+    block->size = (new_size - old_size) | BLOCK_FREE | (block->size & PREV_FREE);
+    coalesce(arena, block);
+
+    return 0;
+}
+
+//Picks the arena for the calling thread: the arena of its CPU, or one handed out in turn
+arena_t* select_arena(void) {
+    if (arena_count == 1) {
+        return &arenas[0];
+    }
+
+    if (arena_select == UMEM_ARENA_PER_CPU) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0) {
+            return &arenas[cpu % arena_count];
+        }
+    }
+
+    if (thread_arena == NULL) {
+        unsigned int index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[index % arena_count];
+    }
+    return thread_arena;
+}
+
+//Returns the arena owning a pointer, or NULL for pointers outside the region
+arena_t* arena_of(void* ptr) {
+    char* address = (char* )ptr;
+
+    if (memory_region == NULL || address < memory_region ||
+        address >= memory_region + arena_stride * arena_count) {
+        return NULL;
+    }
+    return &arenas[(address - memory_region) / arena_stride];
+}
+
+//Takes an arena's lock and frees the blocks other threads queued on it in the meantime
+static void arena_lock(arena_t* arena) {
+    if (thread_safe) {
+        pthread_mutex_lock(&arena->lock);
+        remote_drain(arena);
+    }
+}
+
+static void arena_unlock(arena_t* arena) {
+    if (thread_safe) {
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+//Start of the mapping holding a direct block. The header sits in the first page of the mapping,
+//at its start unless the block is aligned, in which case it ends right before the aligned payload.
+static char* mmap_start(header_t* header) {
+    return (char* )((uintptr_t)header & ~((uintptr_t)getpagesize() - 1));
+}
+
+//Page-rounded length of a mapping holding lead bytes and a payload of size bytes. Returns 0 when the
+//length does not fit a size_t, or the header's size field with compact headers.
+static size_t mmap_length(size_t lead, size_t size, size_t pageSize) {
+    if (size > SIZE_MAX - lead - pageSize) {
+        return 0;
+    }
+    size_t length = ((lead + size + pageSize - 1) / pageSize) * pageSize;
+    if ((length >> MMAP_LENGTH_SHIFT) >> (sizeof(block_word_t) * 8 - 1) != 0) {
+        return 0;
+    }
+    return length;
+}
+
+//Usable size of a direct block, from its payload to the end of the mapping
+static size_t mmap_usable_size(header_t* header) {
+    size_t length = (size_t)header->size << MMAP_LENGTH_SHIFT;
+    return (size_t)(mmap_start(header) + length - (char* )(header + 1));
+}
+
+//Maps a block of its own for a large request. Alignments above the page size map the slack once and
+//unmap it again, so only the pages holding the block stay mapped.
+void* mmap_alloc(size_t size, size_t alignment) {
+    size_t pageSize = getpagesize();
+    size_t lead = sizeof(header_t);
+    if (alignment > lead) {
+        lead = alignment < pageSize ? alignment : pageSize;
+    }
+    size_t length = mmap_length(lead, size, pageSize);
+    size_t slack = alignment > pageSize ? alignment - pageSize : 0;
+    if (length == 0 || slack > SIZE_MAX - length) {
+        return NULL;
+    }
+
+    char* region = mmap(NULL, length + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    char* start = region;
+    if (slack > 0) {
+        start = (char* )((((uintptr_t)region + lead + alignment - 1) & ~(alignment - 1)) - lead);
+        if (start > region) {
+            munmap(region, (size_t)(start - region));
+        }
+        if (start + length < region + length + slack) {
+            munmap(start + length, (size_t)(region + slack - start));
+        }
+    }
+
+    header_t* header = (header_t* )(start + lead) - 1;
+    header->size = length >> MMAP_LENGTH_SHIFT;
+    header->magic = MMAP_MAGIC;
+
+    __atomic_add_fetch(&mmap_allocated, length - lead, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmap_allocations, 1, __ATOMIC_RELAXED);
+    return (void* )(header + 1);
+}
+
+//Unmaps a direct mapping, its pages go back to the OS at once
+void mmap_free(header_t* header) {
+    char* start = mmap_start(header);
+    size_t length = (size_t)header->size << MMAP_LENGTH_SHIFT;
+    __atomic_sub_fetch(&mmap_allocated, mmap_usable_size(header), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmap_deallocations, 1, __ATOMIC_RELAXED);
+
+    header->magic = 0;
+    munmap(start, length);
+}
+
+//Resizes a direct mapping with mremap, which moves the pages instead of copying them.
+//The payload keeps its offset in the page, so alignments up to the page size survive a move.
+void* mmap_realloc(header_t* header, size_t size) {
+    size_t pageSize = getpagesize();
+    char* start = mmap_start(header);
+    size_t lead = (size_t)((char* )(header + 1) - start);
+    size_t old_length = (size_t)header->size << MMAP_LENGTH_SHIFT;
+    size_t length = mmap_length(lead, size, pageSize);
+    if (length == 0) {
+        report_failure("No sufficient free block found.");
+        return NULL;
+    }
+
+    if (length != old_length) {
+        char* moved = mremap(start, old_length, length, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) {
+            report_failure("No sufficient free block found.");
+            return NULL;
+        }
+        header = (header_t* )(moved + lead) - 1;
+        header->size = length >> MMAP_LENGTH_SHIFT;
+        __atomic_add_fetch(&mmap_allocated, length - old_length, __ATOMIC_RELAXED);
+    }
+    return (void* )(header + 1);
+}
+
+//Pushes a block onto the remote free queue of its arena with a single compare-and-swap.
+//The block is linked through the first word after its header, like a cached block.
+void remote_free(arena_t* arena, header_t* header) {
+    __atomic_store_n(&header->magic, REMOTE_MAGIC, __ATOMIC_RELAXED);
+
+    header_t* head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(header_t** )(header + 1) = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, header, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//Frees every block queued on an arena by other threads, called with the arena lock held.
+//The whole queue is taken in one exchange, so pushes never wait on the owner.
+void remote_drain(arena_t* arena) {
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    header_t* header = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (header != NULL) {
+        header_t* next = *(header_t** )(header + 1);
+        header->magic = MAGIC;
+        heap_free(arena, header + 1);
+        header = next;
+    }
+}
+
+//Allocates from the given arena, then from the others if it has no room.
+//An alignment above 8 bytes places the block so that its payload is aligned.
+void* arena_alloc(arena_t* arena, size_t size, size_t alignment) {
+    int first = (int)(arena - arenas);
+
+    for (int i = 0; i < arena_count; i++) {
+        arena_t* current = &arenas[(first + i) % arena_count];
+
+        arena_lock(current);
+        void* ptr = alignment > sizeof(long) ? heap_alloc_aligned(current, size, alignment, sizeof(header_t))
+                                             : heap_alloc(current, size);
+        arena_unlock(current);
+
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+//Untraced body of umalloc, also used by the calls built on it
+void* region_alloc(size_t size) {
+    if (memory_region == NULL) {
+        fprintf(stderr, "Memory region is not initialized.\n");
+        return NULL;
+    }
+
+    if (size == 0) {
+        report_failure("Requested size is invalid or exceeds available memory.");
+        return NULL;
+    }
+
+    //Large requests bypass the heap so they cannot fragment it
+    if (mmap_threshold > 0 && size >= mmap_threshold) {
+        void* ptr = mmap_alloc(size, 0);
+        if (ptr == NULL) {
+            report_failure("No sufficient free block found.");
+        }
+        return ptr;
+    }
+
+    //Small requests come from the headerless size classes when they are enabled
+    if (size <= size_class_limit) {
+        return umem_cache_alloc(class_cache(size));
+    }
+
+    //Small requests are served from the calling thread's cache without taking a lock
+    if (thread_safe && size <= TCACHE_MAX_SIZE) {
+        void* ptr = tcache_alloc(size);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+
+    void* ptr = arena_alloc(select_arena(), size, 0);
+    if (ptr == NULL) {
+        report_failure("No sufficient free block found.");
+    }
+    return ptr;
+}
+
+void* umalloc(size_t size) {
+    void* ptr = region_alloc(size);
+    trace_event(UMEM_TRACE_MALLOC, ptr, 0, size);
+    return ptr;
+}
+
+//Allocates a block whose payload is aligned to a power of two. The block is cut out of a free block
+//at the aligned address and the gap in front of it stays free, so nothing is over-allocated.
+void* umemalign(size_t alignment, size_t size) {
+    if (memory_region == NULL) {
+        fprintf(stderr, "Memory region is not initialized.\n");
+        return NULL;
+    }
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        fprintf(stderr, "Alignment %zu is not a power of two.\n", alignment);
+        return NULL;
+    }
+
+    //Every block is 8-byte aligned already, size-class objects are 16-byte aligned
+    if (alignment <= sizeof(long) || (alignment <= SIZE_CLASS_STEP && class_sized(size))) {
+        return umalloc(size);
+    }
+
+    if (size == 0) {
+        report_failure("Requested size is invalid or exceeds available memory.");
+        return NULL;
+    }
+
+    bool mapped = mmap_threshold > 0 && size >= mmap_threshold;
+    void* ptr = mapped ? mmap_alloc(size, alignment) : arena_alloc(select_arena(), size, alignment);
+    if (ptr == NULL) {
+        report_failure("No sufficient free block found.");
+    }
+    trace_event(UMEM_TRACE_MEMALIGN, ptr, alignment, size);
+    return ptr;
+}
+
+void* ualigned_alloc(size_t alignment, size_t size) {
+    return umemalign(alignment, size);
+}
+
+//Allocates a zeroed array of n elements. Fresh mappings and the pages of an arena that are known
+//to be zero are not touched, so a large buffer costs no more page faults than its first use.
+void* ucalloc(size_t n, size_t size) {
+    void* ptr = region_calloc(n, size);
+    trace_event(UMEM_TRACE_CALLOC, ptr, 0, n * size);
+    return ptr;
+}
+
+//Untraced body of ucalloc
+void* region_calloc(size_t n, size_t size) {
+    if (memory_region == NULL) {
+        fprintf(stderr, "Memory region is not initialized.\n");
+        return NULL;
+    }
+
+    if (size != 0 && n > SIZE_MAX / size) {
+        report_failure("Requested size is invalid or exceeds available memory.");
+        return NULL;
+    }
+    size_t total = n * size;
+
+    //A direct mapping comes from the kernel zeroed
+    if (mmap_threshold > 0 && total >= mmap_threshold) {
+        void* ptr = mmap_alloc(total, 0);
+        if (ptr == NULL) {
+            report_failure("No sufficient free block found.");
+        }
+        return ptr;
+    }
+
+    //Below a page nothing can be skipped, the block is cleared like any other
+    if (total < zero_page_size) {
+        void* ptr = region_alloc(total);
+        if (ptr != NULL) {
+            memset(ptr, 0, total);
+        }
+        return ptr;
+    }
+
+    arena_t* arena = select_arena();
+    int first = (int)(arena - arenas);
+    for (int i = 0; i < arena_count; i++) {
+        arena_t* current = &arenas[(first + i) % arena_count];
+
+        arena_lock(current);
+        current->clear_blocks = true;
+        void* ptr = heap_alloc(current, total);
+        current->clear_blocks = false;
+        arena_unlock(current);
+
+        if (ptr != NULL) {
+            //Buddy blocks are not carved, and their arenas keep no zero map
+            if (current->zero_map == NULL) {
+                memset(ptr, 0, total);
+            }
+            return ptr;
+        }
+    }
+
+    report_failure("No sufficient free block found.");
+    return NULL;
+}
+
+//Allocates n blocks of the same size under one lock per arena. Returns the number of blocks
+//allocated, the entries of out past them are NULL.
+size_t umalloc_batch(size_t size, size_t n, void** out) {
+    size_t count = 0;
+
+    if (memory_region == NULL) {
+        fprintf(stderr, "Memory region is not initialized.\n");
+        return 0;
+    }
+
+    if (size == 0) {
+        report_failure("Requested size is invalid or exceeds available memory.");
+        return 0;
+    }
+
+    if (mmap_threshold > 0 && size >= mmap_threshold) {
+        while (count < n && (out[count] = mmap_alloc(size, 0)) != NULL) {
+            count++;
+        }
+    } else if (class_sized(size)) {
+        umem_cache_t* cache = class_cache(size);
+        while (count < n && (out[count] = umem_cache_alloc(cache)) != NULL) {
+            count++;
+        }
+    } else {
+        arena_t* arena = select_arena();
+        int first = (int)(arena - arenas);
+
+        for (int i = 0; i < arena_count && count < n; i++) {
+            arena_t* current = &arenas[(first + i) % arena_count];
+
+            arena_lock(current);
+            count += heap_alloc_batch(current, size, n - count, out + count);
+            arena_unlock(current);
+        }
+    }
+
+    if (count < n) {
+        report_failure("No sufficient free block found.");
+        memset(out + count, 0, (n - count) * sizeof(void* ));
+    }
+    for (size_t i = 0; i < count; i++) {
+        trace_event(UMEM_TRACE_MALLOC, out[i], 0, size);
+    }
+    return count;
+}
+
+//Untraced body of ufree
+void region_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    //Headerless objects of the size classes are found without reading them
+    arena_t* arena = arena_of(ptr);
+    slab_t* slab = arena != NULL ? class_slab_of(arena, ptr) : NULL;
+    if (slab != NULL) {
+        umem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    //Pointers outside the region can only be direct mappings
+    header_t* header = (header_t* )ptr - 1;
+    if (arena == NULL && header->magic == MMAP_MAGIC) {
+        mmap_free(header);
+        return;
+    }
+    if (arena == NULL || header->magic != MAGIC) {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+        exit(1);
+    }
+
+    if (thread_safe && tcache_free(header)) {
+        return;
+    }
+
+    //Blocks of another thread's arena are queued for their owner instead of taking its lock
+    if (thread_safe && arena != select_arena()) {
+        remote_free(arena, header);
+        return;
+    }
+
+    //Frees always go back to the arena that owns the block
+    arena_lock(arena);
+    heap_free(arena, ptr);
+    arena_unlock(arena);
+}
+
+//Frees are recorded first, another thread may get the address as soon as it is free
+void ufree(void* ptr) {
+    trace_event(UMEM_TRACE_FREE, ptr, 0, 0);
+    region_free(ptr);
+}
+
+static int compare_addresses(const void* a, const void* b) {
+    char* left = *(char* const* )a;
+    char* right = *(char* const* )b;
+    return (left > right) - (left < right);
+}
+
+//Frees n blocks, sorting ptrs in place by address. Sorting groups the blocks by arena, so each
+//arena is locked once, and puts neighbours side by side so they are merged in a single pass.
+void ufree_batch(void** ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        trace_event(UMEM_TRACE_FREE, ptrs[i], 0, 0);
+    }
+    qsort(ptrs, n, sizeof(void* ), compare_addresses);
+
+    size_t i = 0;
+    while (i < n) {
+        arena_t* arena = arena_of(ptrs[i]);
+
+        //NULL pointers, direct mappings, size-class objects and foreign pointers take the regular path
+        if (arena == NULL || class_slab_of(arena, ptrs[i]) != NULL) {
+            region_free(ptrs[i]);
+            i++;
+            continue;
+        }
+
+        size_t end = i + 1;
+        while (end < n && arena_of(ptrs[end]) == arena && class_slab_of(arena, ptrs[end]) == NULL) {
+            end++;
+        }
+
+        arena_lock(arena);
+        heap_free_batch(arena, ptrs + i, end - i);
+        arena_unlock(arena);
+        i = end;
+    }
+}
+
+//Frees a block of a known requested size, the size last passed to umalloc, ucalloc, urealloc or
+//umalloc_batch for it. Every request of a class size is served by its class, so the size alone picks
+//the cache and the slab map is not consulted. Other blocks take the regular path. Debug builds check
+//size against the block.
+void ufree_sized(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    trace_event(UMEM_TRACE_FREE_SIZED, ptr, 0, size);
+
+    bool sized = class_sized(size);
+
+#ifndef NDEBUG
+    arena_t* arena = arena_of(ptr);
+    slab_t* slab = arena != NULL ? class_slab_of(arena, ptr) : NULL;
+    header_t* header = (header_t* )ptr - 1;
+    bool mismatch = slab != NULL && (!sized || slab->cache->object_size != ((size - 1) / SIZE_CLASS_STEP + 1) * SIZE_CLASS_STEP);
+    if (slab == NULL && arena != NULL && header->magic == MAGIC &&
+        ((size_t)__atomic_load_n(&header->size, __ATOMIC_RELAXED) & ~SIZE_FLAGS) < size) {
+        mismatch = true;
+    }
+    if (mismatch) {
+        fprintf(stderr, "Error: Size %zu does not match block %p\n", size, ptr);
+        exit(1);
+    }
+#endif
+
+    //Aligned blocks of a class size still come from the heap, only the slab map tells them apart
+    if (sized) {
+        arena_t* owner = arena_of(ptr);
+        slab_t* owner_slab = owner != NULL ? class_slab_of(owner, ptr) : NULL;
+        if (owner_slab != NULL) {
+            umem_cache_free(owner_slab->cache, ptr);
+            return;
+        }
+    }
+    region_free(ptr);
+}
+
+//Usable size of a block, which is at least the size requested. Returns 0 for pointers umem did not
+//hand out, so callers can tell its blocks from foreign ones.
+size_t umalloc_usable_size(void* ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    arena_t* arena = arena_of(ptr);
+    slab_t* slab = arena != NULL ? class_slab_of(arena, ptr) : NULL;
+    if (slab != NULL) {
+        return slab->cache->object_size;
+    }
+
+    header_t* header = (header_t* )ptr - 1;
+    if (arena == NULL) {
+        return header->magic == MMAP_MAGIC ? mmap_usable_size(header) : 0;
+    }
+    return (size_t)__atomic_load_n(&header->size, __ATOMIC_RELAXED) & ~SIZE_FLAGS;
+}
+
+//Untraced body of urealloc
+void* region_realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return region_alloc(size);
+    }
+
+    //A size-class object stays put while the size maps to its class, otherwise it is copied out
+    arena_t* arena = arena_of(ptr);
+    slab_t* slab = arena != NULL ? class_slab_of(arena, ptr) : NULL;
+    if (slab != NULL) {
+        size_t object_size = slab->cache->object_size;
+        if (size > 0 && size <= object_size && size + SIZE_CLASS_STEP > object_size) {
+            return ptr;
+        }
+
+        void* new_ptr = size > 0 ? region_alloc(size) : NULL;
+        if (new_ptr != NULL || size == 0) {
+            if (new_ptr != NULL) {
+                memcpy(new_ptr, ptr, object_size < size ? object_size : size);
+            }
+            umem_cache_free(slab->cache, ptr);
+        }
+        return new_ptr;
+    }
+
+    //Other threads may flip PREV_FREE under the arena lock meanwhile
+    header_t* header = (header_t* )ptr - 1;
+    size_t current_size = (size_t)__atomic_load_n(&header->size, __ATOMIC_RELAXED) & ~SIZE_FLAGS;
+
+    //Direct mappings are resized by the kernel, or move back into the heap once they are small
+    if (arena == NULL && header->magic == MMAP_MAGIC) {
+        if (size == 0) {
+            mmap_free(header);
+            return NULL;
+        }
+        if (size >= mmap_threshold) {
+            return mmap_realloc(header, size);
+        }
+
+        //Aligned blocks may be mapped below the threshold, so the copy is bounded by both sizes
+        current_size = mmap_usable_size(header);
+        void* new_ptr = region_alloc(size);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, current_size < size ? current_size : size);
+            mmap_free(header);
+        }
+        return new_ptr;
+    }
+
+    if (arena == NULL) {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+        exit(1);
+    }
+
+    //A block shrinking to a class size moves into its class, ufree_sized relies on the size alone
+    if (class_sized(size)) {
+        void* new_ptr = region_alloc(size);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, current_size < size ? current_size : size);
+            region_free(ptr);
+        }
+        return new_ptr;
+    }
+
+    //A block growing past the threshold gets its own mapping, so growing it further needs no copy
+    if (mmap_threshold > 0 && size >= mmap_threshold) {
+        void* new_ptr = mmap_alloc(size, 0);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, current_size < size ? current_size : size);
+            region_free(ptr);
+            return new_ptr;
+        }
+    }
+
+    arena_lock(arena);
+    void* new_ptr = heap_realloc(arena, ptr, size);
+    arena_unlock(arena);
+
+    //The owning arena is full, move the block to another one
+    if (new_ptr == NULL && size > 0) {
+        new_ptr = region_alloc(size);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, current_size < size ? current_size : size);
+            region_free(ptr);
+        }
+    }
+    return new_ptr;
+}
+
+void* urealloc(void* ptr, size_t size) {
+    void* new_ptr = region_realloc(ptr, size);
+    trace_event(UMEM_TRACE_REALLOC, new_ptr, (size_t)ptr, size);
+    return new_ptr;
+}
+
+//Allocates from an arena, the caller holds the arena lock in thread-safe mode
+void* heap_alloc(arena_t* arena, size_t size) {
+    //Failures are reported by umalloc once no arena can serve the request
+    if (size == 0 || size > arena->reserved_memory) {
+        return NULL;
+    }
+
+    //Round up the requested size to the nearest multiple of 8
+    size = (size + 7) & ~7;
+
+    //Calculate the total required size with header alignment
+    size_t allocation_size = size + sizeof(header_t);
+
+    //The buddy allocator manages its own free lists
+    if (arena->alloc_algorithm == BUDDY) {
+        void* ptr = buddy_alloc(arena, allocation_size, 0);
+        if (ptr == NULL && arena_grow(arena, allocation_size) == 0) {
+            ptr = buddy_alloc(arena, allocation_size, 0);
+        }
+        return ptr;
+    }
+
+    //Every block must be able to hold a free node and footer once it is freed
+    if (allocation_size < arena->min_free_block) {
+        allocation_size = arena->min_free_block;
+    }
+
+    //A block of the same size freed recently is reused as it is
+    size_t usable_size = allocation_size - sizeof(header_t);
+    if (usable_size <= quick_bin_max && arena->quick_bins[usable_size / 8] != NULL) {
+        header_t* header = arena->quick_bins[usable_size / 8];
+        arena->quick_bins[usable_size / 8] = *(header_t** )(header + 1);
+        arena->quick_bytes -= allocation_size;
+        arena->quick_blocks--;
+        arena->allocated_memory += usable_size;
+        arena->total_allocations++;
+        header->magic = MAGIC;
+        return (void* )(header + 1);
+    }
+
+    node_t* selected = NULL;
+    if (allocation_size <= arena->free_memory) {
+        selected = find_free_block(arena, allocation_size);
+    }
+
+    //Merge the parked blocks before the arena grows
+    if (selected == NULL && arena_consolidate(arena)) {
+        selected = find_free_block(arena, allocation_size);
+    }
+
+    //Commit more of the arena when no free block fits
+    if (selected == NULL && arena_grow(arena, allocation_size) == 0) {
+        selected = find_free_block(arena, allocation_size);
+    }
+
+    if (selected == NULL) {
+        return NULL;
+    }
+
+    //Return the memory address to the user (after the header)
+    return carve_block(arena, selected, allocation_size);
+}
+
+//Allocates a block whose header address plus offset is a multiple of alignment (a power of two),
+//the caller holds the arena lock in thread-safe mode. The gap in front of it becomes a free block.
+void* heap_alloc_aligned(arena_t* arena, size_t size, size_t alignment, size_t offset) {
+    if (size == 0 || size > arena->reserved_memory || alignment > arena->reserved_memory) {
+        return NULL;
+    }
+
+    //Round up the requested size to the nearest multiple of 8
+    size = (size + 7) & ~7;
+    size_t allocation_size = size + sizeof(header_t);
+
+    //Buddy blocks of at least alignment bytes all start the same distance past an aligned address,
+    //so the header goes that far into the block
+    if (arena->alloc_algorithm == BUDDY) {
+        size_t lead = (alignment - ((uintptr_t)arena->memory_region + offset) % alignment) % alignment;
+        if (lead + allocation_size < alignment) {
+            allocation_size = alignment - lead;
+        }
+        void* ptr = buddy_alloc(arena, allocation_size, lead);
+        if (ptr == NULL && arena_grow(arena, buddy_block_bytes(allocation_size, lead)) == 0) {
+            ptr = buddy_alloc(arena, allocation_size, lead);
+        }
+        return ptr;
+    }
+
+    //Every block must be able to hold a free node and footer once it is freed
+    if (allocation_size < arena->min_free_block) {
+        allocation_size = arena->min_free_block;
+    }
+
+    //A block this large holds an aligned block after a gap that is either empty or can stand on its own
+    size_t search_size = allocation_size + alignment + arena->min_free_block;
+    node_t* selected = NULL;
+    if (search_size <= arena->free_memory) {
+        selected = find_free_block(arena, search_size);
+    }
+    if (selected == NULL && arena_consolidate(arena)) {
+        selected = find_free_block(arena, search_size);
+    }
+    if (selected == NULL && arena_grow(arena, search_size) == 0) {
+        selected = find_free_block(arena, search_size);
+    }
+    if (selected == NULL) {
+        return NULL;
+    }
+
+    char* start = (char* )selected;
+    char* aligned = (char* )((((uintptr_t)start + offset + alignment - 1) & ~(alignment - 1)) - offset);
+    while (aligned != start && (size_t)(aligned - start) < arena->min_free_block) {
+        aligned += alignment;
+    }
+
+    //Split the gap off, the aligned block now follows a free block
+    if (aligned != start) {
+        size_t gap = (size_t)(aligned - start);
+        size_t block_size = size_field(selected);
+
+        free_block_remove(arena, selected);
+        selected->size = gap | BLOCK_FREE;
+        write_footer(selected, gap);
+        free_block_insert(arena, selected);
+
+        node_t* rest = (node_t* )aligned;
+        rest->size = (block_size - gap) | BLOCK_FREE | PREV_FREE;
+        write_footer(rest, block_size - gap);
+        free_block_insert(arena, rest);
+        selected = rest;
+    }
+
+    return carve_block(arena, selected, allocation_size);
+}
+
+//Looks up a free block of at least allocation_size bytes with the arena's policy
+node_t* find_free_block(arena_t* arena, size_t allocation_size) {
+    //Choose the allocation algorithm based on alloc_algorithm
+    switch (arena->alloc_algorithm) {
+        case FIRST_FIT:
+            return first_fit(arena, allocation_size);
+        case BEST_FIT:
+            return best_fit(arena, allocation_size);
+        case WORST_FIT:
+            return worst_fit(arena, allocation_size);
+        case NEXT_FIT:
+            return next_fit(arena, allocation_size);
+        case TLSF:
+            return tlsf_find(arena, allocation_size);
+        default:
+            fprintf(stderr, "Unknown allocation algorithm.\n");
+            return NULL;
+    }
+}
+
+//Takes a free block off the free structures, splits off the unused tail and prepares the header
+void* carve_block(arena_t* arena, node_t* selected, size_t allocation_size) {
+    void* ptr;
+    carve_run(arena, selected, allocation_size, 1, &ptr);
+    return ptr;
+}
+
+//Cuts count consecutive blocks of allocation_size bytes off the front of a free block in one pass,
+//so the free structures are only updated once. The caller makes sure the blocks fit.
+void carve_run(arena_t* arena, node_t* selected, size_t allocation_size, size_t count, void** out) {
+    size_t block_size = size_field(selected);
+    long prev_free = selected->size & PREV_FREE;
+    node_t* next_free = selected->next;
+    size_t run_size = allocation_size * count;
+
+    free_block_remove(arena, selected);
+
+    //Determine if we can split the block
+    if (block_size - run_size >= arena->min_free_block) {
+        //Create a new free block for the remaining memory after allocation
+        node_t* new_free_block = (node_t* )((char* )selected + run_size);
+        new_free_block->size = (block_size - run_size) | BLOCK_FREE;
+        write_footer(new_free_block, block_size - run_size);
+        free_block_insert(arena, new_free_block);
+
+        //Update last_allocated to the new free block
+        if (arena->alloc_algorithm == NEXT_FIT) {
+            arena->last_allocated = new_free_block;
+        }
+    } else {
+        //The last block takes the rest if it's too small to split, the block after it loses its free predecessor
+        set_prev_free((char* )selected + block_size, false);
+        run_size = block_size;
+
+        //Update last_allocated to the next free block
+        if (arena->alloc_algorithm == NEXT_FIT) {
+            arena->last_allocated = next_free;
+        }
+    }
+
+    //Prepare the allocated blocks with a header. Only a gap split off in front of an aligned
+    //block can leave a free block before the first one.
+    char* block = (char* )selected;
+    for (size_t i = 0; i < count; i++) {
+        size_t size = i + 1 < count ? allocation_size : (size_t)((char* )selected + run_size - block);
+        header_t* header = (header_t* )block;
+        header->size = (size - sizeof(header_t)) | (i == 0 ? prev_free : 0);  //Store the usable size of the block
+        header->magic = MAGIC;  //Set magic number for integrity check
+        if (arena->clear_blocks) {
+            clear_payload(arena, header, size);
+        }
+        zero_map_clear(arena, block, block + size);
+        out[i] = (void* )(header + 1);
+        block += size;
+    }
+
+    //Update memory statistics
+    arena->free_memory -= run_size;
+    arena->allocated_memory += run_size - count * sizeof(header_t);
+    arena->total_allocations += count;
+}
+
+//Frees a block back to its arena, the caller holds the arena lock in thread-safe mode
+void heap_free(arena_t* arena, void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    //Get the header of the block to free
+    header_t* header = (header_t* )((char* )ptr - sizeof(header_t));
+
+    //Check for memory corruption by verifying the MAGIC number
+    if (header->magic != MAGIC) {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+        exit(1);  //Exit on memory corruption as per specification
+    }
+
+    //Buddy blocks go back to their per-order lists
+    if (arena->alloc_algorithm == BUDDY) {
+        buddy_free(arena, header);
+        purge_check(arena);
+        return;
+    }
+
+    //Update memory statistics
+    size_t usable_size = header->size & ~SIZE_FLAGS;
+    arena->allocated_memory -= usable_size;
+    arena->total_deallocations++;
+
+    //Small blocks are parked in their quick bin without coalescing
+    if (usable_size <= quick_bin_max) {
+        header->magic = QUICK_MAGIC;
+        *(header_t** )(header + 1) = arena->quick_bins[usable_size / 8];
+        arena->quick_bins[usable_size / 8] = header;
+        arena->quick_bytes += usable_size + sizeof(header_t);
+        arena->quick_blocks++;
+        if (arena->quick_bytes > QUICK_BYTES_LIMIT) {
+            arena_consolidate(arena);
+        }
+        return;
+    }
+
+    release_block(arena, header);
+    purge_check(arena);
+}
+
+//Turns an allocated or parked block into a free block, merged with its free neighbours
+void release_block(arena_t* arena, header_t* header) {
+    //Mark block as free by resetting the magic number
+    header->magic = 0;
+
+    size_t allocation_size = (header->size & ~SIZE_FLAGS) + sizeof(header_t);
+    arena->free_memory += allocation_size;
+
+    //Create a new free node for the block being freed, keeping its PREV_FREE bit
+    node_t* new_free_node = (node_t* )header;
+    new_free_node->size = allocation_size | BLOCK_FREE | (header->size & PREV_FREE);
+
+    //Call the coalesce function to merge adjacent free blocks and file the result
+    coalesce(arena, new_free_node);
+}
+
+//Merges every block parked in the quick bins into the free structures, called with the arena
+//lock held. Returns whether there was anything to merge.
+bool arena_consolidate(arena_t* arena) {
+    if (arena->quick_blocks == 0) {
+        return false;
+    }
+
+    for (int i = 0; i < QUICK_BINS; i++) {
+        header_t* header = arena->quick_bins[i];
+        while (header != NULL) {
+            header_t* next = *(header_t** )(header + 1);
+            release_block(arena, header);
+            header = next;
+        }
+        arena->quick_bins[i] = NULL;
+    }
+    arena->quick_bytes = 0;
+    arena->quick_blocks = 0;
+    purge_check(arena);
+    return true;
+}
+
+//Merges the quick bins of every arena, so the free lists show all free memory
+void umemconsolidate(void) {
+    if (memory_region == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < arena_count; i++) {
+        arena_lock(&arenas[i]);
+        arena_consolidate(&arenas[i]);
+        arena_unlock(&arenas[i]);
+    }
+}
+
+//Frees blocks of one arena sorted by address, the caller holds the arena lock in thread-safe mode.
+//Blocks that follow each other are merged into one free block before it is coalesced and filed,
+//so a run of neighbours costs a single update of the free structures.
+void heap_free_batch(arena_t* arena, void** ptrs, size_t count) {
+    if (arena->alloc_algorithm == BUDDY) {
+        for (size_t i = 0; i < count; i++) {
+            heap_free(arena, ptrs[i]);
+        }
+        return;
+    }
+
+    size_t i = 0;
+    while (i < count) {
+        node_t* run = (node_t* )((char* )ptrs[i] - sizeof(header_t));
+        long prev_free = run->size & PREV_FREE;
+        size_t run_size = 0;
+
+        do {
+            header_t* header = (header_t* )((char* )ptrs[i] - sizeof(header_t));
+            if (header->magic != MAGIC) {
+                fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptrs[i]);
+                exit(1);
+            }
+            header->magic = 0;
+
+            size_t usable_size = header->size & ~SIZE_FLAGS;
+            arena->free_memory += usable_size + sizeof(header_t);
+            arena->allocated_memory -= usable_size;
+            arena->total_deallocations++;
+            run_size += usable_size + sizeof(header_t);
+            i++;
+        } while (i < count && (char* )ptrs[i] - sizeof(header_t) == (char* )run + run_size);
+
+        run->size = run_size | BLOCK_FREE | prev_free;
+        coalesce(arena, run);
+    }
+    purge_check(arena);
+}
+
+//Function to coalesce a free block with its physical neighbours in constant time.
+//The next block is found from the size and the previous one through its footer.
+void coalesce(arena_t* arena, node_t* new_free_node) {
+    node_t* block = new_free_node;
+    size_t block_size = size_field(new_free_node);
+
+    //Coalesce with next free block if adjacent
+    node_t* next = (node_t* )((char* )block + block_size);
+    if (next->size & BLOCK_FREE) {
+        free_block_remove(arena, next);
+        block_size += size_field(next);
+    }
+
+    //Coalesce with previous free block if adjacent
+    if (new_free_node->size & PREV_FREE) {
+        size_t prev_size = (size_t)*(long* )((char* )new_free_node - sizeof(long));
+        node_t* prev = (node_t* )((char* )new_free_node - prev_size);
+        free_block_remove(arena, prev);
+        block = prev;
+        block_size += prev_size;
+    }
+
+    block->size = block_size | BLOCK_FREE;
+    write_footer(block, block_size);
+    set_prev_free((char* )block + block_size, true);
+    free_block_insert(arena, block);
+
+    //If the new free node is before last_allocated, update last_allocated
+    if (arena->alloc_algorithm == NEXT_FIT && (arena->last_allocated == NULL || block < arena->last_allocated)) {
+        arena->last_allocated = block;
+    }
+}
+
+//Resizes a block within its arena, the caller holds the arena lock in thread-safe mode
+void* heap_realloc(arena_t* arena, void* ptr, size_t size) {
+    //If ptr is NULL, behave like umalloc
+    if (ptr == NULL) {
+        return heap_alloc(arena, size);
+    }
+    //If size is 0, behave like ufree
+    if (size == 0) {
+        heap_free(arena, ptr);
+        return NULL;
+    }
+
+    //A size no arena can hold would wrap below when it is rounded up
+    if (size > arena->reserved_memory) {
+        return NULL;
+    }
+
+    //Get the header of the current block
+    header_t* header = (header_t* )ptr - 1;
+    size_t current_size = header->size & ~SIZE_FLAGS;
+
+    //Round up the new requested size to the nearest multiple of 8 for alignment
+    size = (size + 7) & ~7;
+
+    //Buddy blocks have a fixed power-of-two capacity, so they can only be reused as is or moved
+    if (arena->alloc_algorithm == BUDDY) {
+        if (size <= current_size) {
+            return ptr;
+        }
+        return relocate_block(arena, ptr, current_size, size);
+    }
+
+    //Calculate the total allocation size with header for the requested size
+    size_t allocation_size = size + sizeof(header_t);
+    size_t block_size = current_size + sizeof(header_t);
+    if (allocation_size < arena->min_free_block) {
+        allocation_size = arena->min_free_block;
+    }
+
+    //The status bits tell in constant time whether the physical neighbours are free
+    node_t* next_block = (node_t* )((char* )header + block_size);
+    size_t next_size = (next_block->size & BLOCK_FREE) ? size_field(next_block) : 0;
+    size_t prev_size = (header->size & PREV_FREE) ? (size_t)*(long* )((char* )header - sizeof(long)) : 0;
+
+    //Expand the block over the whole next block when that is enough, any excess is given back below
+    if (allocation_size > block_size && next_size > 0 &&
+        (block_size + next_size >= allocation_size || block_size + next_size + prev_size >= allocation_size)) {
+        free_block_remove(arena, next_block);
+        zero_map_clear(arena, (char* )next_block, (char* )next_block + next_size);
+        block_size += next_size;
+        arena->free_memory -= next_size;
+        arena->allocated_memory += next_size;
+        header->size = (block_size - sizeof(header_t)) | (header->size & PREV_FREE);
+        set_prev_free((char* )header + block_size, false);
+    }
+
+    //Otherwise absorb the free block in front and slide the data down into it,
+    //which is still cheaper than a new block and a copy
+    if (allocation_size > block_size && prev_size > 0 && block_size + prev_size >= allocation_size) {
+        node_t* prev_block = (node_t* )((char* )header - prev_size);
+        free_block_remove(arena, prev_block);
+        zero_map_clear(arena, (char* )prev_block, (char* )prev_block + prev_size);
+        block_size += prev_size;
+        arena->free_memory -= prev_size;
+        arena->allocated_memory += prev_size;
+
+        //A free block always follows an allocated one, so the moved header has no free predecessor
+        header = (header_t* )prev_block;
+        memmove(header + 1, ptr, current_size);
+        header->size = block_size - sizeof(header_t);
+        header->magic = MAGIC;
+        ptr = (void* )(header + 1);
+    }
+
+    //Case 5: Allocate a new block, copy data, free old block
+    if (allocation_size > block_size) {
+        return relocate_block(arena, ptr, current_size, size);
+    }
+
+    //Give back the tail when it is large enough to stand on its own
+    if (block_size - allocation_size >= arena->min_free_block) {
+        node_t* rest = (node_t* )((char* )header + allocation_size);
+        size_t rest_size = block_size - allocation_size;
+
+        header->size = (allocation_size - sizeof(header_t)) | (header->size & PREV_FREE);
+        arena->free_memory += rest_size;
+        arena->allocated_memory -= rest_size;
+
+        rest->size = rest_size | BLOCK_FREE;
+        coalesce(arena, rest);
+    }
+
+    return ptr;
+}
+
+//Moves an allocated block to a new block of the requested size and frees the old one
+void* relocate_block(arena_t* arena, void* ptr, size_t current_size, size_t size) {
+    void* new_ptr = heap_alloc(arena, size);
+    if (new_ptr == NULL) {
+        return NULL; 
+    }
+
+    //Copy data from old block to new block
+    size_t bytes_to_copy;
+    if (current_size < size) {
+        bytes_to_copy = current_size;
+    } else {
+        bytes_to_copy = size;
+    }
+    memcpy(new_ptr, ptr, bytes_to_copy);
+
+    //Free the old block
+    heap_free(arena, ptr);
+
+    return new_ptr;
+}
+
+//Current time in milliseconds for the purge decay
+static long purge_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//Page-aligned interior of a free block. The free node at its start and the footer at its
+//end stay resident, so the block can still be linked and coalesced after a purge.
+static size_t purge_span(arena_t* arena, void* block, size_t size, char** start) {
+    size_t pageSize = page_size;
+    size_t first = ((size_t)block + arena->min_free_block + pageSize - 1) & ~(pageSize - 1);
+    size_t last = ((size_t)block + size - sizeof(long)) & ~(pageSize - 1);
+
+    *start = (char* )first;
+    return last > first ? last - first : 0;
+}
+
+//What a purge pass hands to its visitor
+typedef struct {
+    arena_t* arena;
+    int advice;                         //MADV_DONTNEED drops pages at once, MADV_FREE when memory runs low
+} purge_t;
+
+//Visitor that gives the interior pages of a free block back to the OS. Blocks purged lazily
+//before are only advised again when the pages have to go now.
+static void purge_block(void* block, size_t size, void* arg) {
+    purge_t* purge = (purge_t* )arg;
+    bool purged = (*(block_word_t* )block & BLOCK_PURGED) != 0;
+    char* start;
+
+    if (purged && purge->advice != MADV_DONTNEED) {
+        return;
+    }
+
+    size_t span = purge_span(purge->arena, block, size, &start);
+    if (span == 0 || madvise(start, span, purge->advice) != 0) {
+        return;
+    }
+
+    if (!purged) {
+        *(block_word_t* )block |= BLOCK_PURGED;
+        purge->arena->purged_memory += span;
+    }
+
+    //Dropped pages read back as zeros, lazily freed ones may still hold the old data
+    if (purge->advice == MADV_DONTNEED) {
+        zero_map_set(purge->arena, start, start + span);
+    }
+}
+
+//Leaves the purged state when a free block is taken off the free structures
+static void purge_forget(arena_t* arena, void* block) {
+    char* start;
+
+    if (*(block_word_t* )block & BLOCK_PURGED) {
+        *(block_word_t* )block &= ~BLOCK_PURGED;
+        arena->purged_memory -= purge_span(arena, block, size_field(block), &start);
+    }
+}
+
+//Gives the unused pages of an arena's free blocks back to the OS, called with the arena lock held.
+//Returns the number of bytes newly purged.
+size_t arena_trim(arena_t* arena, int advice) {
+    size_t purged = arena->purged_memory;
+    purge_t purge = { arena, advice };
+
+    for_each_free_block(arena, purge_block, &purge);
+    arena->last_purge = purge_clock();
+    arena->purge_ticks = 0;
+    arena->purge_floor = arena->free_memory - arena->purged_memory;
+
+    return arena->purged_memory - purged;
+}
+
+//Purges an arena when its dirty free memory grew by the threshold or has been around for the decay time.
+//Growth is measured from the lowest point since the last purge, as small blocks are never purged.
+//These purges are lazy where the kernel supports it, so reusing the pages early costs no page faults.
+void purge_check(arena_t* arena) {
+    size_t dirty = arena->free_memory - arena->purged_memory;
+
+    if (dirty < arena->purge_floor) {
+        arena->purge_floor = dirty;
+    }
+    if (purge_threshold > 0 && dirty - arena->purge_floor > purge_threshold) {
+        arena_trim(arena, PURGE_LAZY);
+        return;
+    }
+
+    if (purge_decay > 0 && ++arena->purge_ticks >= PURGE_CLOCK_INTERVAL) {
+        arena->purge_ticks = 0;
+        if (purge_clock() - arena->last_purge >= purge_decay) {
+            arena_trim(arena, PURGE_LAZY);
+        }
+    }
+}
+
+size_t umemtrim(void) {
+    size_t purged = 0;
+
+    if (memory_region == NULL) {
+        return 0;
+    }
+
+    //Parked blocks are merged first, so their pages can go too
+    for (int i = 0; i < arena_count; i++) {
+        arena_lock(&arenas[i]);
+        arena_consolidate(&arenas[i]);
+        purged += arena_trim(&arenas[i], MADV_DONTNEED);
+        arena_unlock(&arenas[i]);
+    }
+    return purged;
+}
+
+//Adds the calling thread's cache hits to the counters of an arena, called with its lock held
+static void tcache_flush_stats(arena_t* arena) {
+    arena->total_allocations += tcache.allocations;
+    arena->total_deallocations += tcache.deallocations;
+    tcache.allocations = 0;
+    tcache.deallocations = 0;
+}
+
+//Returns up to count blocks of a class from the calling thread's cache to their arenas. Blocks of the
+//thread's own arena are freed under one lock, the others are queued for their owners.
+static void tcache_drain(tcache_t* cache, int size_class, int count) {
+    arena_t* own = select_arena();
+    bool locked = false;
+
+    int drained = 0;
+    while (drained < count && cache->blocks[size_class] != NULL) {
+        header_t* header = cache->blocks[size_class];
+        arena_t* arena = arena_of(header);
+        cache->blocks[size_class] = *(header_t** )(header + 1);
+        drained++;
+
+        //The block was already counted as freed when it entered the cache
+        if (arena != own) {
+            cache->deallocations--;
+            remote_free(arena, header);
+            continue;
+        }
+
+        if (!locked) {
+            arena_lock(own);
+            tcache_flush_stats(own);
+            locked = true;
+        }
+        header->magic = MAGIC;
+        heap_free(own, header + 1);
+        own->total_deallocations--;
+    }
+    cache->counts[size_class] -= drained;
+
+    if (locked) {
+        arena_unlock(own);
+    }
+}
+
+//Thread exit destructor: hand every cached block back to the heap
+static void tcache_destroy(void* arg) {
+    tcache_t* cache = (tcache_t* )arg;
+
+    //Destructors of other keys may still allocate and free, nothing would drain the cache again
+    cache->destroyed = true;
+    for (int size_class = 0; size_class < TCACHE_CLASSES; size_class++) {
+        tcache_drain(cache, size_class, cache->counts[size_class]);
+    }
+
+    //Blocks queued on other arenas may have left counts behind that no lock has picked up yet
+    arena_t* arena = select_arena();
+    arena_lock(arena);
+    tcache_flush_stats(arena);
+    arena_unlock(arena);
+}
+
+static void tcache_make_key(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+//Sets up the exit destructor the first time a thread uses its cache
+static void tcache_register(void) {
+    if (!tcache.registered) {
+        pthread_once(&tcache_once, tcache_make_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = true;
+    }
+}
+
+//Fills a class of the calling thread's cache with a batch of blocks taken under one arena lock
+static void tcache_refill(int size_class) {
+    size_t size = (size_t)(size_class + 1) * TCACHE_CLASS_SIZE;
+    arena_t* arena = select_arena();
+    int filled = 0;
+
+    tcache_register();
+
+    arena_lock(arena);
+    tcache_flush_stats(arena);
+
+    while (filled < TCACHE_BATCH) {
+        void* ptr = heap_alloc(arena, size);
+        if (ptr == NULL) {
+            break;
+        }
+        header_t* header = (header_t* )ptr - 1;
+        header->magic = TCACHE_MAGIC;
+        *(header_t** )ptr = tcache.blocks[size_class];
+        tcache.blocks[size_class] = header;
+        filled++;
+    }
+    tcache.counts[size_class] += filled;
+
+    //Blocks only count as allocations once they leave the cache
+    arena->total_allocations -= filled;
+
+    arena_unlock(arena);
+}
+
+//Pops a block for a small request from the calling thread's cache, refilling the class when empty
+void* tcache_alloc(size_t size) {
+    int size_class = (int)((size - 1) / TCACHE_CLASS_SIZE);
+
+    if (tcache.destroyed) {
+        return NULL;
+    }
+    if (tcache.counts[size_class] == 0) {
+        tcache_refill(size_class);
+    }
+
+    header_t* header = tcache.blocks[size_class];
+    if (header == NULL) {
+        return NULL;
+    }
+    tcache.blocks[size_class] = *(header_t** )(header + 1);
+    tcache.counts[size_class]--;
+    tcache.allocations++;
+
+    //The buddy allocator peeks at the magic of neighbouring blocks under the lock
+    __atomic_store_n(&header->magic, MAGIC, __ATOMIC_RELAXED);
+    return (void* )(header + 1);
+}
+
+//Parks a small block in the calling thread's cache, draining a batch first when the class is full.
+//Returns false for blocks too large to cache, and once the thread's cache has been destroyed.
+bool tcache_free(header_t* header) {
+    if (tcache.destroyed) {
+        return false;
+    }
+
+    //Other threads may flip status bits of this header under the lock, the size bits never change
+    size_t usable_size = (size_t)__atomic_load_n(&header->size, __ATOMIC_RELAXED) & ~SIZE_FLAGS;
+    if (usable_size < TCACHE_CLASS_SIZE || usable_size > TCACHE_MAX_SIZE) {
+        return false;
+    }
+
+    int size_class = (int)(usable_size / TCACHE_CLASS_SIZE) - 1;
+    if (tcache.counts[size_class] >= TCACHE_LIMIT) {
+        tcache_drain(&tcache, size_class, TCACHE_BATCH);
+    }
+    tcache_register();
+
+    __atomic_store_n(&header->magic, TCACHE_MAGIC, __ATOMIC_RELAXED);
+    *(header_t** )(header + 1) = tcache.blocks[size_class];
+    tcache.blocks[size_class] = header;
+    tcache.counts[size_class]++;
+    tcache.deallocations++;
+    return true;
+}
+
+//Offset of the in_use bitmap of a slab holding count objects, right after its free_stack
+static size_t slab_bitmap_offset(int count) {
+    size_t offset = sizeof(header_t) + sizeof(slab_t) + count * sizeof(unsigned short);
+    return (offset + sizeof(unsigned long) - 1) & ~(sizeof(unsigned long) - 1);
+}
+
+//Bytes in front of the objects of a slab holding count objects
+static size_t slab_overhead(int count, size_t alignment) {
+    size_t overhead = slab_bitmap_offset(count) + (count + SLAB_BITS - 1) / SLAB_BITS * sizeof(unsigned long);
+    return (overhead + alignment - 1) & ~(alignment - 1);
+}
+
+//Sets up a cache whose slabs are a power of two of at least min_slab bytes
+void cache_init(umem_cache_t* cache, const char* name, size_t size, size_t align, size_t min_slab) {
+    memset(cache, 0, sizeof(umem_cache_t));
+    strncpy(cache->name, name != NULL ? name : "", CACHE_NAME_LENGTH - 1);
+    cache->object_size = (size + align - 1) & ~(align - 1);
+    cache->align = align;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    //Start at the smallest slab and double until enough objects fit
+    cache->slab_size = min_slab;
+    while (cache->slab_size < align ||
+           cache->slab_size < slab_overhead(SLAB_MIN_OBJECTS, align) + SLAB_MIN_OBJECTS * cache->object_size) {
+        cache->slab_size *= 2;
+    }
+
+    int count = (int)((cache->slab_size - sizeof(header_t) - sizeof(slab_t)) / (cache->object_size + sizeof(unsigned short)));
+    if (count > SLAB_MAX_OBJECTS) {
+        count = SLAB_MAX_OBJECTS;
+    }
+    while (slab_overhead(count, align) + count * cache->object_size > cache->slab_size) {
+        count--;
+    }
+    cache->objects_per_slab = count;
+}
+
+umem_cache_t* umem_cache_create(const char* name, size_t size, size_t align,
+                                void (*constructor)(void* object), void (*destructor)(void* object)) {
+    if (memory_region == NULL) {
+        fprintf(stderr, "Memory region is not initialized.\n");
+        return NULL;
+    }
+
+    if (align == 0) {
+        align = sizeof(long);
+    }
+    if (size == 0 || (align & (align - 1)) != 0) {
+        report_failure("Requested size is invalid or exceeds available memory.");
+        return NULL;
+    }
+
+    umem_cache_t* cache = region_alloc(sizeof(umem_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache_init(cache, name, size, align, getpagesize());
+    cache->constructor = constructor;
+    cache->destructor = destructor;
+
+    pthread_mutex_lock(&user_caches_lock);
+    cache->next = user_caches;
+    user_caches = cache;
+    pthread_mutex_unlock(&user_caches_lock);
+
+    return cache;
+}
+
+
+//Carves a new slab from the heap and constructs its objects, called with the cache lock held
+static slab_t* slab_create(umem_cache_t* cache) {
+    size_t slab_size = cache->slab_size;
+    arena_t* arena = cache->arena != NULL ? cache->arena : select_arena();
+
+    //An aligned heap block puts the slab right after its header
+    arena_lock(arena);
+    void* block = heap_alloc_aligned(arena, slab_size - sizeof(header_t), slab_size, 0);
+    arena_unlock(arena);
+    char* base = (char* )block - sizeof(header_t);
+
+    //Otherwise, take twice the size from any arena and use the aligned half in the middle
+    if (block == NULL) {
+        block = arena_alloc(arena, 2 * slab_size, 0);
+        if (block == NULL) {
+            return NULL;
+        }
+        base = (char* )(((uintptr_t)block + slab_size - 1) & ~(slab_size - 1));
+    }
+
+    slab_t* slab = (slab_t* )(base + sizeof(header_t));
+    slab->cache = cache;
+    slab->block = block;
+    slab->bytes = umalloc_usable_size(block);
+    cache->slabs_created++;
+    cache->slabs++;
+    cache->slab_bytes += slab->bytes;
+    if (cache->size_class) {
+        class_slab_mark(base, true);
+    }
+    slab->objects = base + slab_overhead(cache->objects_per_slab, cache->align);
+    slab->in_use = (unsigned long* )(base + slab_bitmap_offset(cache->objects_per_slab));
+    memset(slab->in_use, 0, (cache->objects_per_slab + SLAB_BITS - 1) / SLAB_BITS * sizeof(unsigned long));
+    slab->free_count = cache->objects_per_slab;
+
+    //Hand out the lowest addresses first
+    for (int i = 0; i < cache->objects_per_slab; i++) {
+        slab->free_stack[i] = (unsigned short)(cache->objects_per_slab - 1 - i);
+        if (cache->constructor != NULL) {
+            cache->constructor(slab->objects + i * cache->object_size);
+        }
+    }
+    return slab;
+}
+
+//Runs the destructor over every object of a slab and gives the slab back to the heap
+static void slab_destroy(umem_cache_t* cache, slab_t* slab) {
+    if (cache->destructor != NULL) {
+        for (int i = 0; i < cache->objects_per_slab; i++) {
+            cache->destructor(slab->objects + i * cache->object_size);
+        }
+    }
+    if (cache->size_class) {
+        class_slab_mark((char* )slab - sizeof(header_t), false);
+    }
+    slab->cache = NULL;
+    cache->slabs--;
+    cache->slab_bytes -= slab->bytes;
+    region_free(slab->block);
+}
+
+static void slab_push(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_unlink(slab_t** list, slab_t* slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+void* umem_cache_alloc(umem_cache_t* cache) {
+    if (thread_safe) {
+        pthread_mutex_lock(&cache->lock);
+    }
+
+    slab_t* slab = cache->partial_slabs;
+    if (slab == NULL) {
+        slab = cache->empty_slab;
+        cache->empty_slab = NULL;
+        if (slab == NULL) {
+            slab = slab_create(cache);
+        }
+        if (slab == NULL) {
+            if (thread_safe) {
+                pthread_mutex_unlock(&cache->lock);
+            }
+            report_failure("No sufficient free block found.");
+            return NULL;
+        }
+        slab_push(&cache->partial_slabs, slab);
+    }
+
+    int index = slab->free_stack[--slab->free_count];
+    cache->allocations++;
+    slab->in_use[index / SLAB_BITS] |= 1UL << (index % SLAB_BITS);
+    if (slab->free_count == 0) {
+        slab_unlink(&cache->partial_slabs, slab);
+        slab_push(&cache->full_slabs, slab);
+    }
+
+    if (thread_safe) {
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return slab->objects + index * cache->object_size;
+}
+
+void umem_cache_free(umem_cache_t* cache, void* object) {
+    if (object == NULL) {
+        return;
+    }
+
+    //The slab is found from the object's address, check that it really is one of ours
+    char* base = (char* )((uintptr_t)object & ~(cache->slab_size - 1));
+    slab_t* slab = (slab_t* )(base + sizeof(header_t));
+    size_t offset = (size_t)((char* )object - slab->objects);
+    if (arena_of(object) == NULL || slab->cache != cache || (char* )object < slab->objects ||
+        offset % cache->object_size != 0 || offset / cache->object_size >= (size_t)cache->objects_per_slab) {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", object);
+        exit(1);
+    }
+
+    if (thread_safe) {
+        pthread_mutex_lock(&cache->lock);
+    }
+
+    //An object whose bit is already clear was freed before
+    size_t index = offset / cache->object_size;
+    unsigned long bit = 1UL << (index % SLAB_BITS);
+    if ((slab->in_use[index / SLAB_BITS] & bit) == 0) {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", object);
+        exit(1);
+    }
+    slab->in_use[index / SLAB_BITS] &= ~bit;
+    cache->deallocations++;
+
+    slab->free_stack[slab->free_count++] = (unsigned short)index;
+    if (slab->free_count == 1) {
+        slab_unlink(&cache->full_slabs, slab);
+        slab_push(&cache->partial_slabs, slab);
+    }
+
+    //Keep one empty slab around and give any other back to the heap
+    if (slab->free_count == cache->objects_per_slab) {
+        slab_unlink(&cache->partial_slabs, slab);
+        if (cache->empty_slab == NULL) {
+            cache->empty_slab = slab;
+        } else {
+            slab_destroy(cache, slab);
+        }
+    }
+
+    if (thread_safe) {
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+//Gives every slab back to the heap, objects still allocated from the cache are released with it
+void umem_cache_destroy(umem_cache_t* cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&user_caches_lock);
+    struct umem_cache** link = &user_caches;
+    while (*link != NULL && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = cache->next;
+    }
+    pthread_mutex_unlock(&user_caches_lock);
+
+    slab_t* lists[2] = { cache->partial_slabs, cache->full_slabs };
+    for (int i = 0; i < 2; i++) {
+        slab_t* slab = lists[i];
+        while (slab != NULL) {
+            slab_t* next = slab->next;
+            slab_destroy(cache, slab);
+            slab = next;
+        }
+    }
+    if (cache->empty_slab != NULL) {
+        slab_destroy(cache, cache->empty_slab);
+    }
+
+    //The heap counted the slabs as blocks and saw them freed, the objects take their place
+    pthread_mutex_lock(&user_caches_lock);
+    retired_objects += cache->allocations - cache->slabs_created;
+    pthread_mutex_unlock(&user_caches_lock);
+
+    pthread_mutex_destroy(&cache->lock);
+    region_free(cache);
+}
+
+//Sets up the policy of a heap over its memory, a bump heap only needs its offset cleared
+static int heap_setup(umem_heap_t* heap) {
+    heap->offset = 0;
+    if (heap->algorithm == UMEM_BUMP) {
+        return 0;
+    }
+    return arena_init(heap->arena, heap->base, heap->size, heap->size, heap->algorithm);
+}
+
+//Releases what arena_init set up outside the heap memory
+static void heap_teardown(umem_heap_t* heap) {
+    if (heap->arena != NULL && heap->arena->free_map_bytes > 0) {
+        munmap(heap->arena->free_map[0], heap->arena->free_map_bytes);
+        heap->arena->free_map_bytes = 0;
+    }
+}
+
+umem_heap_t* umem_heap_create(size_t size, int algorithm) {
+    if (algorithm < BEST_FIT || algorithm > UMEM_BUMP) {
+        fprintf(stderr, "Unknown allocation algorithm.\n");
+        return NULL;
+    }
+
+    //Round up the size to the nearest multiple of 8
+    size = (size + 7) & ~7;
+    if (algorithm != UMEM_BUMP && size > ARENA_SIZE_LIMIT) {
+        fprintf(stderr, "Heap is too large for compact headers.\n");
+        return NULL;
+    }
+
+    umem_heap_t* heap = region_alloc(sizeof(umem_heap_t));
+    if (heap == NULL) {
+        return NULL;
+    }
+    memset(heap, 0, sizeof(umem_heap_t));
+    heap->algorithm = algorithm;
+    heap->size = size;
+    heap->base = region_alloc(size);
+
+    if (heap->base != NULL && algorithm != UMEM_BUMP) {
+        heap->arena = region_alloc(sizeof(arena_t));
+    }
+    if (heap->base == NULL || (algorithm != UMEM_BUMP && (heap->arena == NULL || heap_setup(heap) != 0))) {
+        region_free(heap->arena);
+        region_free(heap->base);
+        region_free(heap);
+        return NULL;
+    }
+    return heap;
+}
+
+void* umem_heap_alloc(umem_heap_t* heap, size_t size) {
+    if (heap->algorithm != UMEM_BUMP) {
+        return heap_alloc(heap->arena, size);
+    }
+
+    //Round up the requested size to the nearest multiple of 8
+    size = (size + 7) & ~7;
+    if (size == 0 || size > heap->size - heap->offset) {
+        return NULL;
+    }
+
+    void* ptr = heap->base + heap->offset;
+    heap->offset += size;
+    return ptr;
+}
+
+//Frees a block of a heap. Blocks of a bump heap are only freed by a reset or rollback.
+void umem_heap_free(umem_heap_t* heap, void* ptr) {
+    if (ptr == NULL || heap->algorithm == UMEM_BUMP) {
+        return;
+    }
+
+    if ((char* )ptr < heap->base || (char* )ptr >= heap->base + heap->size) {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+        exit(1);
+    }
+    heap_free(heap->arena, ptr);
+}
+
+//Frees every block of a heap at once, its free map is kept
+void umem_heap_reset(umem_heap_t* heap) {
+    heap->offset = 0;
+    if (heap->algorithm != UMEM_BUMP) {
+        arena_reset(heap->arena);
+    }
+}
+
+size_t umem_heap_mark(umem_heap_t* heap) {
+    return heap->offset;
+}
+
+//Frees every block a bump heap handed out since the mark was taken
+void umem_heap_rollback(umem_heap_t* heap, size_t mark) {
+    if (heap->algorithm != UMEM_BUMP || mark > heap->offset) {
+        fprintf(stderr, "Error: Invalid heap mark %zu\n", mark);
+        return;
+    }
+    heap->offset = mark;
+}
+
+void umem_heap_destroy(umem_heap_t* heap) {
+    if (heap == NULL) {
+        return;
+    }
+
+    heap_teardown(heap);
+    region_free(heap->arena);
+    region_free(heap->base);
+    region_free(heap);
+}
+
+//Allocates up to count blocks of the same size from an arena, the caller holds the arena lock in
+//thread-safe mode. Each free block found is carved into as many blocks as it holds, and the first
+//search asks for room for the whole batch. Returns the number of blocks allocated.
+size_t heap_alloc_batch(arena_t* arena, size_t size, size_t count, void** out) {
+    size_t allocated = 0;
+
+    if (size == 0 || size > arena->reserved_memory) {
+        return 0;
+    }
+
+    //Buddy blocks come from their per-order lists one at a time, but under a single lock
+    if (arena->alloc_algorithm == BUDDY) {
+        while (allocated < count && (out[allocated] = heap_alloc(arena, size)) != NULL) {
+            allocated++;
+        }
+        return allocated;
+    }
+
+    //Round up the requested size to the nearest multiple of 8
+    size = (size + 7) & ~7;
+    size_t allocation_size = size + sizeof(header_t);
+    if (allocation_size < arena->min_free_block) {
+        allocation_size = arena->min_free_block;
+    }
+
+    while (allocated < count) {
+        size_t remaining = count - allocated;
+        node_t* selected = NULL;
+
+        //The size of a batch too large to count saturates, no block holds it and growing takes
+        //the whole reservation
+        size_t batch_size;
+        if (__builtin_mul_overflow(remaining, allocation_size, &batch_size)) {
+            batch_size = SIZE_MAX;
+        }
+
+        //A block holding the rest of the batch, else any block that fits at least one. The list
+        //policies would walk past every smaller block, so they take the first block that fits one.
+        bool indexed = arena->alloc_algorithm != FIRST_FIT && arena->alloc_algorithm != NEXT_FIT;
+        if (indexed && batch_size <= arena->free_memory) {
+            selected = find_free_block(arena, batch_size);
+        }
+        if (selected == NULL && allocation_size <= arena->free_memory) {
+            selected = find_free_block(arena, allocation_size);
+        }
+        if (selected == NULL && arena_consolidate(arena)) {
+            selected = find_free_block(arena, allocation_size);
+        }
+        if (selected == NULL &&
+            arena_grow(arena, batch_size < arena->reserved_memory ? batch_size : arena->reserved_memory) == 0) {
+            selected = find_free_block(arena, allocation_size);
+        }
+        if (selected == NULL) {
+            break;
+        }
+
+        size_t fits = size_field(selected) / allocation_size;
+        size_t run = fits < remaining ? fits : remaining;
+        carve_run(arena, selected, allocation_size, run, out + allocated);
+        allocated += run;
+    }
+
+    return allocated;
+}
+
+//First Fit algorithm: Find the first block that fits the requested size
+node_t* first_fit(arena_t* arena, size_t allocation_size) {
+    node_t* current = arena->free_list;
+
+    while (current != NULL) {
+        if (size_field(current) >= allocation_size) {
+            return current;
+        }
+        current = current->next;
+    }
+    return NULL;
+}
+
+//Best Fit algorithm: Find the smallest block that fits the requested size.
+//The size index makes this a lower-bound lookup; ties go to the lowest address.
+node_t* best_fit(arena_t* arena, size_t allocation_size) {
+    tree_node_t* current = arena->size_tree;
+    tree_node_t* best = NULL;
+
+    while (current != NULL) {
+        if (size_field(current) >= allocation_size) {
+            best = current;
+            current = current->left;
+        } else {
+            current = current->right;
+        }
+    }
+    return (node_t* )best;
+}
+
+//Worst Fit algorithm: Find the largest block that fits the requested size.
+//The largest size sits at the right end of the size index; ties go to the lowest address.
+node_t* worst_fit(arena_t* arena, size_t allocation_size) {
+    tree_node_t* current = arena->size_tree;
+
+    if (current == NULL) {
+        return NULL;
+    }
+    while (current->right != NULL) {
+        current = current->right;
+    }
+    if (size_field(current) < allocation_size) {
+        return NULL;
+    }
+    return best_fit(arena, size_field(current));
+}
+
+//Next Fit algorithm: Find the next block from the last allocated block
+node_t* next_fit(arena_t* arena, size_t allocation_size) {
+    if (arena->free_list == NULL) {
+        return NULL;  //No free blocks available
+    }
+
+    //Start the search from last_allocated, or from the head if last_allocated is NULL
+    node_t* current = arena->last_allocated != NULL ? arena->last_allocated : arena->free_list;
+
+    //Keep a pointer to the start of our search to know when we've wrapped around
+    node_t* start = current;
+
+    //Search from current to the end of the free list, wrapping around if necessary
+    do {
+        if (size_field(current) >= allocation_size) {
+            return current;
+        }
+
+        //Move to the next node
+        current = current->next ? current->next : arena->free_list;  //Wrap around if at the end
+    } while (current != start);
+
+    //No suitable block found
+    return NULL;
+}
+
+//Returns the smallest order whose block can hold the given number of bytes
+static int buddy_order(size_t bytes) {
+    int order = BUDDY_MIN_ORDER;
+    while (((size_t)1 << order) < bytes) {
+        order++;
+    }
+    return order;
+}
+
+//Returns the address of the buddy of a block, or NULL if the buddy lies outside the region
+static buddy_node_t* buddy_of(arena_t* arena, void* block, int order) {
+    size_t offset = (size_t)((char* )block - (char* )arena->memory_region);
+    size_t buddy_offset = offset ^ ((size_t)1 << order);
+
+    if (buddy_offset + ((size_t)1 << order) > arena->total_memory) {
+        return NULL;
+    }
+    return (buddy_node_t* )((char* )arena->memory_region + buddy_offset);
+}
+
+//Pushes a free block onto the list for its order
+static void buddy_push(arena_t* arena, buddy_node_t* block, int order) {
+    block->size = (long)1 << order;
+    block->magic = BUDDY_FREE;
+    block->prev = NULL;
+    block->next = arena->buddy_lists[order];
+    if (arena->buddy_lists[order] != NULL) {
+        arena->buddy_lists[order]->prev = block;
+    }
+    arena->buddy_lists[order] = block;
+    free_stats_add(arena, (size_t)1 << order);
+}
+
+//Unlinks a free block from the list for its order
+static void buddy_unlink(arena_t* arena, buddy_node_t* block, int order) {
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        arena->buddy_lists[order] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    block->magic = 0;
+    purge_forget(arena, block);
+    free_stats_remove(arena, (size_t)1 << order);
+}
+
+//Files a free block, merging with the buddy for as long as it is free and of the same order
+static void buddy_release(arena_t* arena, buddy_node_t* block, int order) {
+    while (order < BUDDY_MAX_ORDER) {
+        buddy_node_t* buddy = buddy_of(arena, block, order);
+        //An allocated buddy's magic may be rewritten by its owner's thread cache without the lock
+        if (buddy == NULL || __atomic_load_n(&buddy->magic, __ATOMIC_RELAXED) != BUDDY_FREE ||
+            (buddy->size & ~SIZE_FLAGS) != (long)1 << order) {
+            break;
+        }
+
+        buddy_unlink(arena, buddy, order);
+        if (buddy < block) {
+            block = buddy;
+        }
+        order++;
+    }
+
+    buddy_push(arena, block, order);
+}
+
+//Buddy allocator setup: carve the region into the largest naturally aligned power-of-two blocks
+void buddy_init(arena_t* arena) {
+    size_t size = arena->total_memory;
+
+    for (int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        arena->buddy_lists[order] = NULL;
+    }
+
+    arena->total_memory = 0;
+    buddy_carve(arena, 0, size);
+}
+
+//Carves the range [offset, end) of the arena into naturally aligned blocks and releases them,
+//merging each with a free buddy below it. The arena grows block by block, so buddies are
+//never looked up in memory that has not been carved yet.
+void buddy_carve(arena_t* arena, size_t offset, size_t end) {
+    while (offset + ((size_t)1 << BUDDY_MIN_ORDER) <= end) {
+        int order = BUDDY_MIN_ORDER;
+
+        //Grow the block while it stays aligned to its own size and inside the range
+        while (order < BUDDY_MAX_ORDER &&
+               offset % ((size_t)1 << (order + 1)) == 0 &&
+               offset + ((size_t)1 << (order + 1)) <= end) {
+            order++;
+        }
+
+        arena->total_memory = offset + ((size_t)1 << order);
+        buddy_release(arena, (buddy_node_t* )((char* )arena->memory_region + offset), order);
+        offset += (size_t)1 << order;
+    }
+    arena->total_memory = end;
+}
+
+//Bytes of the buddy block holding allocation_size bytes lead bytes past its start. The header must
+//leave more than half of the block behind it, so buddy_free finds the order from the usable size.
+size_t buddy_block_bytes(size_t allocation_size, size_t lead) {
+    if (lead > 0 && allocation_size <= lead) {
+        return 2 * lead + 1;
+    }
+    return lead + allocation_size;
+}
+
+//Buddy allocation: take the smallest non-empty order that fits and split it down. The header is
+//placed lead bytes into the block, an aligned request has its payload past the start.
+void* buddy_alloc(arena_t* arena, size_t allocation_size, size_t lead) {
+    int order = buddy_order(buddy_block_bytes(allocation_size, lead));
+    int current = order;
+
+    while (current <= BUDDY_MAX_ORDER && arena->buddy_lists[current] == NULL) {
+        current++;
+    }
+
+    if (current > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+
+    buddy_node_t* block = arena->buddy_lists[current];
+    buddy_unlink(arena, block, current);
+
+    //Split off the upper halves until the block has the requested order
+    while (current > order) {
+        current--;
+        buddy_push(arena, (buddy_node_t* )((char* )block + ((size_t)1 << current)), current);
+    }
+
+    //The header records the usable capacity up to the end of the block so ufree can recover the order
+    size_t block_size = (size_t)1 << order;
+    header_t* header = (header_t* )((char* )block + lead);
+    header->size = block_size - lead - sizeof(header_t);
+    header->magic = MAGIC;
+
+    arena->free_memory -= block_size;
+    arena->allocated_memory += header->size;
+    arena->total_allocations++;
+
+    return (void* )(header + 1);
+}
+
+//Buddy free: hand the block back to the per-order lists
+void buddy_free(arena_t* arena, header_t* header) {
+    int order = buddy_order(header->size + sizeof(header_t));
+    size_t block_size = (size_t)1 << order;
+
+    //The block ends where the payload does, its header may sit past the start
+    buddy_node_t* block = (buddy_node_t* )((char* )(header + 1) + header->size - block_size);
+
+    header->magic = 0;
+    arena->free_memory += block_size;
+    arena->allocated_memory -= header->size;
+    arena->total_deallocations++;
+
+    buddy_release(arena, block, order);
+}
+
+//Index of the most significant set bit
+static int fls_index(size_t value) {
+    return 63 - __builtin_clzl(value);
+}
+
+//Maps a block size to its first and second level list
+static void tlsf_mapping(size_t size, int* fl, int* sl) {
+    if (size < TLSF_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = (int)(size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT));
+    } else {
+        int bit = fls_index(size);
+        *sl = (int)(size >> (bit - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = bit - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+//Adds a free block to the head of its segregated list
+static void tlsf_insert(arena_t* arena, node_t* block) {
+    int fl, sl;
+    tlsf_mapping(size_field(block), &fl, &sl);
+
+    block->prev = NULL;
+    block->next = arena->tlsf_lists[fl][sl];
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
+    arena->tlsf_lists[fl][sl] = block;
+
+    arena->tlsf_fl_bitmap |= 1UL << fl;
+    arena->tlsf_sl_bitmap[fl] |= 1U << sl;
+}
+
+//Removes a free block from its segregated list
+static void tlsf_remove(arena_t* arena, node_t* block) {
+    int fl, sl;
+    tlsf_mapping(size_field(block), &fl, &sl);
+
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        arena->tlsf_lists[fl][sl] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+
+    //Clear the bitmap bits once a list runs empty
+    if (arena->tlsf_lists[fl][sl] == NULL) {
+        arena->tlsf_sl_bitmap[fl] &= ~(1U << sl);
+        if (arena->tlsf_sl_bitmap[fl] == 0) {
+            arena->tlsf_fl_bitmap &= ~(1UL << fl);
+        }
+    }
+}
+
+//TLSF search: two bitmap lookups find a list whose blocks are all large enough
+node_t* tlsf_find(arena_t* arena, size_t allocation_size) {
+    int fl, sl;
+
+    //Round the request up to the next list boundary so any block in the list fits
+    size_t search_size = allocation_size;
+    if (search_size >= TLSF_SMALL_BLOCK) {
+        search_size += ((size_t)1 << (fls_index(search_size) - TLSF_SL_LOG2)) - 1;
+    }
+    tlsf_mapping(search_size, &fl, &sl);
+
+    unsigned int sl_map = fl < TLSF_FL_COUNT ? arena->tlsf_sl_bitmap[fl] & (~0U << sl) : 0;
+    if (sl_map == 0) {
+        unsigned long fl_map = fl + 1 < TLSF_FL_COUNT ? arena->tlsf_fl_bitmap & (~0UL << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = arena->tlsf_sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    return arena->tlsf_lists[fl][sl];
+}
+
+//Treap priority of a block, hashed from its address
+static unsigned long tree_priority(tree_node_t* node) {
+    return ((unsigned long)node >> 3) * 0x9E3779B97F4A7C15UL;
+}
+
+//Orders blocks by size, then by address
+static bool tree_less(tree_node_t* a, tree_node_t* b) {
+    size_t a_size = size_field(a);
+    size_t b_size = size_field(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+//Splits a subtree into the keys below node and the keys above it
+static void tree_split(tree_node_t* root, tree_node_t* node, tree_node_t** left, tree_node_t** right) {
+    if (root == NULL) {
+        *left = NULL;
+        *right = NULL;
+    } else if (tree_less(root, node)) {
+        tree_split(root->right, node, &root->right, right);
+        *left = root;
+    } else {
+        tree_split(root->left, node, left, &root->left);
+        *right = root;
+    }
+}
+
+//Joins two subtrees where every key in left is below every key in right
+static tree_node_t* tree_merge(tree_node_t* left, tree_node_t* right) {
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+    if (tree_priority(left) > tree_priority(right)) {
+        left->right = tree_merge(left->right, right);
+        return left;
+    }
+    right->left = tree_merge(left, right->left);
+    return right;
+}
+
+//Adds a block to the size index, expected O(log n)
+static tree_node_t* tree_insert(tree_node_t* root, tree_node_t* node) {
+    if (root == NULL) {
+        node->left = NULL;
+        node->right = NULL;
+        return node;
+    }
+    if (tree_priority(node) > tree_priority(root)) {
+        tree_split(root, node, &node->left, &node->right);
+        return node;
+    }
+    if (tree_less(node, root)) {
+        root->left = tree_insert(root->left, node);
+    } else {
+        root->right = tree_insert(root->right, node);
+    }
+    return root;
+}
+
+//Removes a block from the size index, expected O(log n)
+static tree_node_t* tree_remove(tree_node_t* root, tree_node_t* node) {
+    if (root == node) {
+        return tree_merge(node->left, node->right);
+    }
+    if (tree_less(node, root)) {
+        root->left = tree_remove(root->left, node);
+    } else {
+        root->right = tree_remove(root->right, node);
+    }
+    return root;
+}
+
+//Maps the free list index next to the region, sized for one bit per granule
+int free_map_init(arena_t* arena) {
+    size_t level_words[FREE_MAP_LEVELS];
+    size_t bits = arena->reserved_memory / FREE_MAP_GRANULE;
+    size_t total_words = 0;
+
+    arena->free_map_levels = 0;
+    do {
+        level_words[arena->free_map_levels] = (bits + 63) / 64;
+        total_words += level_words[arena->free_map_levels];
+        bits = level_words[arena->free_map_levels];
+        arena->free_map_levels++;
+    } while (bits > 1 && arena->free_map_levels < FREE_MAP_LEVELS);
+
+    unsigned long* words = mmap(NULL, total_words * sizeof(unsigned long), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (words == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    arena->free_map_bytes = total_words * sizeof(unsigned long);
+
+    for (int level = 0; level < arena->free_map_levels; level++) {
+        arena->free_map[level] = words;
+        words += level_words[level];
+    }
+    return 0;
+}
+
+//Granule index of a block in the free map
+static size_t free_map_index(arena_t* arena, void* block) {
+    return (size_t)((char* )block - (char* )arena->memory_region) / FREE_MAP_GRANULE;
+}
+
+//Marks a granule as the start of a free block, propagating up while words become non-empty
+static void free_map_set(arena_t* arena, size_t index) {
+    for (int level = 0; level < arena->free_map_levels; level++) {
+        unsigned long* word = &arena->free_map[level][index / 64];
+        bool was_empty = *word == 0;
+        *word |= 1UL << (index % 64);
+        if (!was_empty) {
+            break;
+        }
+        index /= 64;
+    }
+}
+
+//Clears a granule, propagating up while words become empty
+static void free_map_clear(arena_t* arena, size_t index) {
+    for (int level = 0; level < arena->free_map_levels; level++) {
+        unsigned long* word = &arena->free_map[level][index / 64];
+        *word &= ~(1UL << (index % 64));
+        if (*word != 0) {
+            break;
+        }
+        index /= 64;
+    }
+}
+
+//Empties an arena that never grows, as umem_heap_reset does. The free map only has the bits of the
+//blocks on the free list, so clearing those empties it in place and no new mapping is needed.
+void arena_reset(arena_t* arena) {
+    unsigned long* free_map[FREE_MAP_LEVELS];
+    int free_map_levels = arena->free_map_levels;
+    size_t free_map_bytes = arena->free_map_bytes;
+
+    if (free_map_bytes > 0) {
+        for (node_t* block = arena->free_list; block != NULL; block = block->next) {
+            free_map_clear(arena, free_map_index(arena, block));
+        }
+    }
+    memcpy(free_map, arena->free_map, sizeof(free_map));
+
+    //Everything but the memory and the free map starts over
+    void* base = arena->memory_region;
+    size_t size = arena->total_memory;
+    int algorithm = arena->alloc_algorithm;
+    memset(arena, 0, sizeof(arena_t));
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->memory_region = base;
+    arena->total_memory = size;
+    arena->reserved_memory = size;
+    arena->alloc_algorithm = algorithm;
+    memcpy(arena->free_map, free_map, sizeof(free_map));
+    arena->free_map_levels = free_map_levels;
+    arena->free_map_bytes = free_map_bytes;
+
+    arena_format(arena);
+}
+
+//Finds the closest free block below a granule in O(levels): climb until a word has a lower bit set,
+//then descend along the highest set bits
+static node_t* free_map_prev(arena_t* arena, size_t index) {
+    int level = 0;
+
+    while (level < arena->free_map_levels) {
+        unsigned long bits = arena->free_map[level][index / 64] & ((1UL << (index % 64)) - 1);
+        if (bits != 0) {
+            index = (index & ~63UL) + (size_t)(63 - __builtin_clzl(bits));
+            break;
+        }
+        index /= 64;
+        level++;
+    }
+    if (level == arena->free_map_levels) {
+        return NULL;
+    }
+
+    while (level > 0) {
+        level--;
+        index = index * 64 + (size_t)(63 - __builtin_clzl(arena->free_map[level][index]));
+    }
+    return (node_t* )((char* )arena->memory_region + index * FREE_MAP_GRANULE);
+}
+
+//Files a free block in the structure used by the active allocation algorithm
+void free_block_insert(arena_t* arena, node_t* block) {
+    //The node and the footer live in the block's own pages
+    size_t size = size_field(block);
+    zero_map_clear(arena, (char* )block, (char* )block + arena->min_free_block);
+    zero_map_clear(arena, (char* )block + size - sizeof(long), (char* )block + size);
+    free_stats_add(arena, size);
+
+    if (arena->alloc_algorithm == TLSF) {
+        tlsf_insert(arena, block);
+        return;
+    }
+
+    //The free list stays sorted by address, the free map gives the predecessor directly
+    size_t index = free_map_index(arena, block);
+    node_t* prev = free_map_prev(arena, index);
+    free_map_set(arena, index);
+
+    block->prev = prev;
+    if (prev == NULL) {
+        block->next = arena->free_list;
+        arena->free_list = block;
+    } else {
+        block->next = prev->next;
+        prev->next = block;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
+
+    if (arena->alloc_algorithm == BEST_FIT || arena->alloc_algorithm == WORST_FIT) {
+        arena->size_tree = tree_insert(arena->size_tree, (tree_node_t* )block);
+    }
+}
+
+//Takes a free block out of the structure used by the active allocation algorithm
+void free_block_remove(arena_t* arena, node_t* block) {
+    purge_forget(arena, block);
+    free_stats_remove(arena, size_field(block));
+
+    if (arena->alloc_algorithm == TLSF) {
+        tlsf_remove(arena, block);
+        return;
+    }
+
+    free_map_clear(arena, free_map_index(arena, block));
+
+    if (block->prev == NULL) {
+        arena->free_list = block->next;
+    } else {
+        block->prev->next = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
     }
 
-    //Map memory from /dev/zero to simulate a contiguous memory region
-    memory_region = mmap(NULL, sizeOfRegion, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (memory_region == MAP_FAILED) {
-        perror("mmap");
-        close(fd);
-        exit(1);
+    if (arena->alloc_algorithm == BEST_FIT || arena->alloc_algorithm == WORST_FIT) {
+        arena->size_tree = tree_remove(arena->size_tree, (tree_node_t* )block);
     }
 
-    //Close /dev/zero since it’s no longer needed
-    close(fd);
+    //Keep the next fit cursor on a block that is still free
+    if (arena->last_allocated == block) {
+        arena->last_allocated = block->next;
+    }
+}
 
-    //Update memory statistics
-    total_memory = sizeOfRegion;
-    alloc_algorithm = allocationAlgo;
-    free_memory = sizeOfRegion;
+//Calls visit for every free block of the active allocation algorithm
+void for_each_free_block(arena_t* arena, void (*visit)(void* block, size_t size, void* arg), void* arg) {
+    if (arena->alloc_algorithm == BUDDY) {
+        for (int order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
+            for (buddy_node_t* block = arena->buddy_lists[order]; block != NULL; block = block->next) {
+                visit(block, block->size & ~SIZE_FLAGS, arg);
+            }
+        }
+        return;
+    }
 
-    //Initialize the free list with the full block (including header space)
-    node_t* initial_free_block = (node_t* )memory_region;  //Start of free list at beginning of memory region
-    initial_free_block->size = sizeOfRegion;  //Full region is free initially (header overhead will be accounted for during allocation)
-    initial_free_block->next = NULL;  //No other free blocks initially
+    if (arena->alloc_algorithm == TLSF) {
+        for (int fl = 0; fl < TLSF_FL_COUNT; fl++) {
+            for (int sl = 0; sl < TLSF_SL_COUNT; sl++) {
+                for (node_t* block = arena->tlsf_lists[fl][sl]; block != NULL; block = block->next) {
+                    visit(block, size_field(block), arg);
+                }
+            }
+        }
+        return;
+    }
 
-    //Set free list head to the full block
-    free_list = initial_free_block;
-    
-    return 0;  //Success
+    for (node_t* current = arena->free_list; current != NULL; current = current->next) {
+        visit(current, size_field(current), arg);
+    }
 }
 
-
-
-void* umalloc(size_t size) {
-    if (memory_region == NULL) {
-        fprintf(stderr, "Memory region is not initialized.\n");
-        return NULL;
+//Visitor that prints one free block
+static void print_free_block(void* block, size_t size, void* arg) {
+    int* printed = (int* )arg;
+    if ((*printed)++ > 0) {
+        printf(", ");
     }
+    printf("%p: %zu", block, size);
+}
 
-    if (size == 0 || size > free_memory) {
-        fprintf(stderr, "Requested size is invalid or exceeds available memory.\n");
-        return NULL;
+//Debugger for checking the free list
+void print_free_list() {
+    for (int i = 0; i < arena_count; i++) {
+        int printed = 0;
+        if (arena_count > 1) {
+            printf("Arena %d ", i);
+        }
+        printf("Free list: ");
+        arena_lock(&arenas[i]);
+        for_each_free_block(&arenas[i], print_free_block, &printed);
+        arena_unlock(&arenas[i]);
+        printf("\n");
     }
+}
 
-    //Round up the requested size to the nearest multiple of 8
-    size = (size + 7) & ~7;
+//Upper bound on the largest free block from the top non-empty histogram bucket, as every other block
+//in the bucket takes at least the bucket's lower bound
+static size_t histogram_largest(arena_t* arena) {
+    int bucket = UMEM_STATS_BUCKETS - 1;
+    while (arena->free_histogram[bucket] == 0) {
+        bucket--;
+    }
+    size_t low = (size_t)1 << bucket;
+    size_t largest = arena->free_histogram_bytes[bucket] - (arena->free_histogram[bucket] - 1) * low;
+    size_t high = (bucket + 1 < UMEM_STATS_BUCKETS) ? (low << 1) - FREE_MAP_GRANULE : ~(size_t)0;
+    return largest < high ? largest : high;
+}
 
-    //Calculate the total required size with header alignment
-    size_t allocation_size = size + sizeof(header_t);
-    node_t* selected_prev = NULL;
-    node_t* selected = NULL;
+//Largest block on the free structures of an arena, read off the policy's own index. First and next
+//fit have none, and a TLSF list is only bounded by its size range, so when several blocks share the
+//top histogram bucket or list the result is an upper bound.
+static size_t arena_largest_free(arena_t* arena) {
+    if (arena->free_blocks == 0) {
+        return 0;
+    }
 
-    //Choose the allocation algorithm based on alloc_algorithm
-    switch (alloc_algorithm) {
-        case FIRST_FIT:
-            selected = first_fit(allocation_size, &selected_prev);
-            break;
+    switch (arena->alloc_algorithm) {
+        case BUDDY: {
+            int order = BUDDY_MAX_ORDER;
+            while (arena->buddy_lists[order] == NULL) {
+                order--;
+            }
+            return (size_t)1 << order;
+        }
         case BEST_FIT:
-            selected = best_fit(allocation_size, &selected_prev);
-            break;
-        case WORST_FIT:
-            selected = worst_fit(allocation_size, &selected_prev);
-            break;
-        case NEXT_FIT:
-            selected = next_fit(allocation_size, &selected_prev);
-            break;
+        case WORST_FIT: {
+            tree_node_t* node = arena->size_tree;
+            while (node->right != NULL) {
+                node = node->right;
+            }
+            return size_field(node);
+        }
+        case TLSF: {
+            //A lone block on the top list is exact, otherwise the list's range caps the estimate
+            int fl = fls_index(arena->tlsf_fl_bitmap);
+            int sl = fls_index(arena->tlsf_sl_bitmap[fl]);
+            node_t* head = arena->tlsf_lists[fl][sl];
+            if (head->next == NULL) {
+                return size_field(head);
+            }
+            size_t limit = fl == 0 ? (size_t)(sl + 1) * (TLSF_SMALL_BLOCK / TLSF_SL_COUNT)
+                                   : (size_t)(TLSF_SL_COUNT + sl + 1) << (fl + TLSF_FL_SHIFT - 1 - TLSF_SL_LOG2);
+            size_t largest = histogram_largest(arena);
+            return largest < limit - sizeof(long) ? largest : limit - sizeof(long);
+        }
         default:
-            fprintf(stderr, "Unknown allocation algorithm.\n");
-            return NULL;
+            return histogram_largest(arena);
     }
+}
 
-    if (selected == NULL) {
-        fprintf(stderr, "No sufficient free block found.\n");
-        return NULL;
+//Replaces the heap blocks of a cache's slabs by its objects, the rest of the slabs is overhead
+static void cache_stats(umem_cache_t* cache, umem_stats_t* stats) {
+    if (thread_safe) {
+        pthread_mutex_lock(&cache->lock);
     }
+    uint64_t live_bytes = (cache->allocations - cache->deallocations) * cache->object_size;
+    stats->total_allocations += cache->allocations - cache->slabs_created;
+    stats->total_deallocations += cache->deallocations - (cache->slabs_created - cache->slabs);
+    stats->allocated_memory += live_bytes - cache->slab_bytes;
+    stats->header_overhead += cache->slab_bytes - live_bytes;
+    if (thread_safe) {
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
 
-    //Determine if we can split the block
-    if (selected->size >= allocation_size + sizeof(node_t)) {
-        //Create a new free block for the remaining memory after allocation
-        node_t* new_free_block = (node_t* )((char* )selected + allocation_size);
-        new_free_block->size = selected->size - allocation_size;
-        new_free_block->next = selected->next;
-
-        //Update the previous block's next pointer
-        if (selected_prev == NULL) {
-            free_list = new_free_block;
-        } else {
-            selected_prev->next = new_free_block;
-        }
+int umemstats_get(umem_stats_t *stats) {
+    size_t histogram_bytes[UMEM_STATS_BUCKETS] = { 0 };
 
-        //Update last_allocated to the new free block
-        if (alloc_algorithm == NEXT_FIT) {
-            last_allocated = new_free_block;
-        }
-    } else {
-        //Use the entire block if it's too small to split
-        if (selected_prev == NULL) {
-            free_list = selected->next;
-        } else {
-            selected_prev->next = selected->next;
+    if (stats == NULL) {
+        return -1;
+    }
+    memset(stats, 0, sizeof(umem_stats_t));
+
+    //Arenas are read one at a time, so a monitoring thread never holds more than one lock
+    for (int i = 0; i < arena_count; i++) {
+        arena_t* arena = &arenas[i];
+        arena_lock(arena);
+        stats->total_allocations += arena->total_allocations;
+        stats->total_deallocations += arena->total_deallocations;
+        stats->allocated_memory += arena->allocated_memory;
+        stats->free_memory += arena->free_memory;
+        stats->purged_memory += arena->purged_memory;
+        stats->quick_blocks += arena->quick_blocks;
+        stats->quick_bytes += arena->quick_bytes;
+        stats->free_blocks += arena->free_blocks;
+        for (int bucket = 0; bucket < UMEM_STATS_BUCKETS; bucket++) {
+            stats->free_histogram[bucket] += arena->free_histogram[bucket];
+            histogram_bytes[bucket] += arena->free_histogram_bytes[bucket];
         }
-
-        //Update last_allocated to the next free block
-        if (alloc_algorithm == NEXT_FIT) {
-            last_allocated = selected->next;
+        size_t largest = arena_largest_free(arena);
+        if (largest > stats->largest_free_block) {
+            stats->largest_free_block = largest;
         }
+        arena_unlock(arena);
     }
 
-    //Prepare the allocated block with a header
-    header_t* header = (header_t* )selected;
-    header->size = size;  //Store the requested size (not the full block size)
-    header->magic = MAGIC;  //Set magic number for integrity check
-    void* allocated_memory_ptr = (void* )(header + 1);  //Return memory after the header
+    //Direct mappings count as allocated but never as free memory
+    stats->total_allocations += tcache.allocations + __atomic_load_n(&mmap_allocations, __ATOMIC_RELAXED);
+    stats->total_deallocations += tcache.deallocations + __atomic_load_n(&mmap_deallocations, __ATOMIC_RELAXED);
+    stats->mapped_memory = __atomic_load_n(&mmap_allocated, __ATOMIC_RELAXED);
+    stats->allocated_memory += stats->mapped_memory;
 
-    //Update memory statistics
-    free_memory -= allocation_size;
-    allocated_memory += size;
-    total_allocations++;
+    //Every block the heap considers allocated, cached ones included, carries a header. Cache traffic
+    //of other threads is only added when they next take a lock, so the difference can dip below zero.
+    if (stats->total_allocations > stats->total_deallocations) {
+        stats->header_overhead = (stats->total_allocations - stats->total_deallocations) * sizeof(header_t);
+    }
 
-    //Return the memory address to the user (after the header)
-    return allocated_memory_ptr;
+    //Objects of the caches are counted one by one instead of the slabs holding them
+    pthread_mutex_lock(&user_caches_lock);
+    stats->total_allocations += retired_objects;
+    stats->total_deallocations += retired_objects;
+    for (struct umem_cache* cache = user_caches; cache != NULL; cache = cache->next) {
+        cache_stats(cache, stats);
+    }
+    pthread_mutex_unlock(&user_caches_lock);
+    for (int a = 0; a < arena_count; a++) {
+        for (size_t i = 0; i < size_class_limit / SIZE_CLASS_STEP; i++) {
+            cache_stats(&class_caches[a][i], stats);
+        }
+    }
+    stats->fragmentation = histogram_fragmentation(histogram_bytes, stats->largest_free_block, stats->free_memory);
+    return 0;
 }
 
+void umemstats(void){
+    umem_stats_t stats;
 
-void ufree(void* ptr) {
-    if (ptr == NULL) {
+    if (umemstats_get(&stats) != 0) {
         return;
     }
-
-    //Get the header of the block to free
-    header_t* header = (header_t* )((char* )ptr - sizeof(header_t));
-
-    //Check for memory corruption by verifying the MAGIC number
-    if (header->magic != MAGIC) {
-        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
-        exit(1);  //Exit on memory corruption as per specification
+    printumemstats(stats.total_allocations, stats.total_deallocations,
+                   stats.allocated_memory, stats.free_memory, stats.fragmentation);
+    printf("Free Blocks: %llu (largest %llu bytes)\n",
+           (unsigned long long)stats.free_blocks, (unsigned long long)stats.largest_free_block);
+
+    //Blocks parked in the quick bins count as neither allocated nor free until they are merged
+    if (quick_bin_max > 0) {
+        printf("Quick Bins: %llu blocks, %llu bytes\n",
+               (unsigned long long)stats.quick_blocks, (unsigned long long)stats.quick_bytes);
     }
+    printf("Header Overhead: %llu bytes (%zu-byte headers)\n", (unsigned long long)stats.header_overhead, sizeof(header_t));
+}
 
-    //Mark block as free by resetting the magic number
-    header->magic = 0;
-
-    //Update memory statistics
-    size_t allocation_size = header->size + sizeof(header_t);
-    free_memory += allocation_size;
-    allocated_memory -= header->size;
-    total_deallocations++;
-
-    //Create a new free node for the block being freed
-    node_t* new_free_node = (node_t* )header;
-    new_free_node->size = allocation_size; 
-    new_free_node->next = NULL;
+//Writes a snapshot taken with umemstats_get, as "name value" lines or as a single JSON object
+int umemstats_export(FILE *out, int format) {
+    static const char* names[] = {
+        "total_allocations", "total_deallocations", "allocated_memory", "free_memory", "mapped_memory",
+        "purged_memory", "quick_blocks", "quick_bytes", "header_overhead", "free_blocks", "largest_free_block"
+    };
+    umem_stats_t stats;
 
-    //Insert the freed block back into the free list in sorted order by address
-    node_t* prev = NULL;
-    node_t* current = free_list;
+    if (out == NULL || (format != UMEM_STATS_TEXT && format != UMEM_STATS_JSON) || umemstats_get(&stats) != 0) {
+        return -1;
+    }
 
-    while (current != NULL && current < new_free_node) {
-        prev = current;
-        current = current->next;
+    const uint64_t counters[] = {
+        stats.total_allocations, stats.total_deallocations, stats.allocated_memory, stats.free_memory, stats.mapped_memory,
+        stats.purged_memory, stats.quick_blocks, stats.quick_bytes, stats.header_overhead, stats.free_blocks,
+        stats.largest_free_block
+    };
+    int last_bucket = UMEM_STATS_BUCKETS - 1;
+    while (last_bucket > 0 && stats.free_histogram[last_bucket] == 0) {
+        last_bucket--;
     }
 
-    //Link the new free block into the list
-    new_free_node->next = current;
-    if (prev == NULL) {
-        free_list = new_free_node;
+    if (format == UMEM_STATS_TEXT) {
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            fprintf(out, "%s %llu\n", names[i], (unsigned long long)counters[i]);
+        }
+        fprintf(out, "fragmentation %.2f\n", stats.fragmentation);
+        for (int bucket = 0; bucket <= last_bucket; bucket++) {
+            if (stats.free_histogram[bucket] != 0) {
+                fprintf(out, "free_histogram_%zu %llu\n", (size_t)1 << bucket, (unsigned long long)stats.free_histogram[bucket]);
+            }
+        }
     } else {
-        prev->next = new_free_node;
+        fprintf(out, "{");
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            fprintf(out, "\"%s\":%llu,", names[i], (unsigned long long)counters[i]);
+        }
+        fprintf(out, "\"fragmentation\":%.2f,\"free_histogram\":[", stats.fragmentation);
+        for (int bucket = 0; bucket <= last_bucket; bucket++) {
+            fprintf(out, bucket == 0 ? "%llu" : ",%llu", (unsigned long long)stats.free_histogram[bucket]);
+        }
+        fprintf(out, "]}\n");
     }
+    return ferror(out) ? -1 : 0;
+}
 
-    //If the new free node is before last_allocated, update last_allocated
-    if (alloc_algorithm == NEXT_FIT && (last_allocated == NULL || new_free_node < last_allocated)) {
-        last_allocated = new_free_node;
+//Share of free memory in blocks smaller than half the largest free block, in percent. Blocks are
+//only known by their power-of-two bucket, so the bucket holding the threshold is counted pro rata.
+double histogram_fragmentation(const size_t* bytes, size_t largest, size_t free_memory) {
+    if (largest == 0 || free_memory == 0) {
+        return 0.0;
     }
 
-    //Call the coalesce function to merge adjacent free blocks
-    coalesce(new_free_node);
-
+    size_t threshold = largest / 2;
+    double small = 0.0;
+    for (int i = 0; i < UMEM_STATS_BUCKETS && ((size_t)1 << i) < threshold; i++) {
+        size_t low = (size_t)1 << i;
+        if (i + 1 < UMEM_STATS_BUCKETS && (low << 1) <= threshold) {
+            small += (double)bytes[i];
+        } else {
+            small += (double)bytes[i] * (double)(threshold - low) / (double)low;
+        }
+    }
+    return small / (double)free_memory * 100.0;
 }
 
-//Function to coalesce adjacent free blocks
-void coalesce(node_t* new_free_node) {
-
+//Current time in nanoseconds for trace records
+static long trace_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
 
-    //Coalesce with next free block if adjacent
-    if (new_free_node->next != NULL &&
-        (char* )new_free_node + new_free_node->size == (char* )new_free_node->next) {
+//Address of a block in a trace record. Offsets keep traces of different runs comparable, and no
+//block starts at the region base, so 0 is left for NULL.
+static uint64_t trace_offset(void* ptr) {
+    return ptr == NULL ? 0 : (uint64_t)((uintptr_t)ptr - (uintptr_t)memory_region);
+}
 
-        new_free_node->size += new_free_node->next->size;
-        new_free_node->next = new_free_node->next->next;
+//Records one operation in the calling thread's ring. Allocations are recorded after they return and
+//frees before they start, so a reused address never shows up as allocated twice. Never inlined, so
+//the heap profiler can cut its stacks at the public call that got here.
+__attribute__((noinline)) void trace_event(int op, void* ptr, size_t argument, size_t size) {
+    //The heap profiler sees every call, whether a trace is recorded or not
+    if (__atomic_load_n(&profiling, __ATOMIC_ACQUIRE)) {
+        profile_event(op, ptr, argument, size, __builtin_return_address(0));
     }
 
-    //Coalesce with previous free block if adjacent
-    node_t* prev = NULL;
-    node_t* current = free_list;
-
-    //Find the previous block in the free list
-    while (current != NULL && current < new_free_node) {
-        prev = current;
-        current = current->next;
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED) || (ptr == NULL && op != UMEM_TRACE_REALLOC)) {
+        return;
     }
 
-    if (prev != NULL &&
-        (char* )prev + prev->size == (char* )new_free_node) {
-
-        prev->size += new_free_node->size;
-        prev->next = new_free_node->next;
+    //Rings are mapped rather than allocated, and are kept for the threads' next traces
+    trace_ring_t* ring = thread_ring;
+    if (ring == NULL) {
+        ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            return;
+        }
+        ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        thread_ring = ring;
     }
-}
 
-void* urealloc(void* ptr, size_t size) {
-    //If ptr is NULL, behave like umalloc
-    if (ptr == NULL) {
-        return umalloc(size);
-    }
-    //If size is 0, behave like ufree
-    if (size == 0) {
-        ufree(ptr);
-        return NULL;
+    unsigned long head = ring->head;
+    unsigned long used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (used >= TRACE_RING_RECORDS) {
+        __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
     }
-
-    //Get the header of the current block
-    header_t* header = (header_t* )ptr - 1;
-    size_t current_size = header->size;
-
-    //Round up the new requested size to the nearest multiple of 8 for alignment
-    size = (size + 7) & ~7;
-
-    //If the requested size is smaller than or equal to the current block, we can resize in place
-    if (size <= current_size) {
-        header->size = size;  //Simply update the header's size to the new requested size
-        return ptr;
+    if (used == TRACE_RING_RECORDS / 2) {
+        pthread_cond_signal(&trace_wakeup);
     }
 
-    //Calculate the total allocation size with header for the requested size
-    size_t allocation_size = size + sizeof(header_t);
+    umem_trace_record_t* record = &ring->records[head % TRACE_RING_RECORDS];
+    record->time = (uint64_t)(trace_clock() - trace_start);
+    record->address = trace_offset(ptr);
+    record->argument = op == UMEM_TRACE_REALLOC ? trace_offset((void* )argument) : argument;
+    record->size = size;
+    record->op = op;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
-    //Check if we can expand the block in place by checking the next free block
-    node_t* next_block = (node_t* )((char* )header + sizeof(header_t) + header->size);
+//Writes the records of every ring that the flusher has not written yet
+static void trace_flush(void) {
+    trace_ring_t* ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
 
-    //Verify if next_block is a free block by checking if it exists in the free list
-    node_t* prev = NULL;
-    node_t* current = free_list;
-    int is_free = 0;
+    for (; ring != NULL; ring = ring->next) {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
 
-    while (current != NULL) {
-        if (current == next_block) {
-            is_free = 1;
-            break;
+        //The unwritten records wrap around the end of the ring at most once
+        while (tail != head) {
+            size_t start = tail % TRACE_RING_RECORDS;
+            size_t count = head - tail;
+            if (count > TRACE_RING_RECORDS - start) {
+                count = TRACE_RING_RECORDS - start;
+            }
+            fwrite(&ring->records[start], sizeof(umem_trace_record_t), count, trace_file);
+            tail += count;
         }
-        prev = current;
-        current = current->next;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
     }
+}
 
-    if (is_free && next_block->size >= allocation_size - current_size) {
-        //Expand the block
-        if (next_block->size >= allocation_size - current_size + sizeof(node_t)) {
-            //Split the next block if there's extra space
-            node_t* new_free_block = (node_t* )((char* )next_block + allocation_size - current_size);
-            new_free_block->size = next_block->size - (allocation_size - current_size);
-            new_free_block->next = next_block->next;
-
-            //Update the free list
-            if (prev == NULL) {
-                free_list = new_free_block;
-            } else {
-                prev->next = new_free_block;
-            }
-        } else {
-            //Remove the entire next block from the free list if it cannot be split
-            if (prev == NULL) {
-                free_list = next_block->next;
-            } else {
-                prev->next = next_block->next;
-            }
+//Body of the flusher thread. A missed wakeup only delays the flush to the next interval.
+static void* trace_flush_loop(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&trace_lock);
+    while (__atomic_load_n(&tracing, __ATOMIC_ACQUIRE)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRACE_FLUSH_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
+        pthread_cond_timedwait(&trace_wakeup, &trace_lock, &deadline);
+        trace_flush();
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
 
-        //Update header to the new size and free/allocated memory tracking
-        header->size = size;
-        free_memory -= (allocation_size - current_size);
-        allocated_memory += (size - current_size);
-        return ptr;
+int umemtrace(const char* path) {
+    //A NULL path ends the trace: the flusher writes what is left and the file is closed
+    if (path == NULL) {
+        if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+            return -1;
+        }
+        __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+        pthread_cond_signal(&trace_wakeup);
+        pthread_join(trace_flusher, NULL);
+        trace_flush();
+        fclose(trace_file);
+        trace_file = NULL;
+
+        unsigned long dropped = __atomic_exchange_n(&trace_dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            fprintf(stderr, "Trace dropped %lu records, the flusher fell behind.\n", dropped);
+        }
+        return 0;
     }
 
-    //Case 5: Allocate a new block, copy data, free old block
-    void* new_ptr = umalloc(size);
-    if (new_ptr == NULL) {
-        return NULL; 
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "A trace is already being recorded.\n");
+        return -1;
     }
 
-    //Copy data from old block to new block
-    size_t bytes_to_copy;
-    if (current_size < size) {
-        bytes_to_copy = current_size;
-    } else {
-        bytes_to_copy = size;
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        perror("Failed to open trace file");
+        return -1;
     }
-    memcpy(new_ptr, ptr, bytes_to_copy);
+    fwrite(UMEM_TRACE_MAGIC, 1, strlen(UMEM_TRACE_MAGIC), trace_file);
 
-    //Free the old block
-    ufree(ptr);
+    //Records left over from an earlier trace are skipped
+    for (trace_ring_t* ring = trace_rings; ring != NULL; ring = ring->next) {
+        __atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    }
 
-    return new_ptr;
+    trace_start = trace_clock();
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&trace_flusher, NULL, trace_flush_loop, NULL) != 0) {
+        __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    return 0;
 }
 
-void umemstats(void){
-    double fragmentation = calculate_fragmentation();
+//Home slot of a block in profile_blocks and profile_filter
+static size_t profile_slot(void* ptr) {
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL >> (64 - PROFILE_BLOCK_BITS));
+}
 
-    printumemstats(total_allocations, total_deallocations, allocated_memory, free_memory, fragmentation);
+//Bytes until the next sample, exponentially distributed with mean rate. The logarithm is taken from
+//the exponent and a quadratic fit of log2(m) + 1 over the mantissa, plenty for sampling and no libm.
+static long profile_interval(size_t rate) {
+    profile_random ^= profile_random >> 12;
+    profile_random ^= profile_random << 25;
+    profile_random ^= profile_random >> 27;
+    double u = (double)(((profile_random * 0x2545F4914F6CDD1DULL) >> 11) + 1) / 9007199254740992.0;
+
+    uint64_t bits;
+    memcpy(&bits, &u, sizeof(bits));
+    int exponent = (int)((bits >> 52) & 0x7ff) - 1024;
+    bits = (bits & 0xFFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double mantissa;
+    memcpy(&mantissa, &bits, sizeof(mantissa));
+    double log2 = exponent + (-0.34484843 * mantissa + 2.02466578) * mantissa - 0.67487759;
+
+    return (long)(-log2 * 0.6931471805599453 * (double)rate) + 1;
 }
 
-//First Fit algorithm: Find the first block that fits the requested size
-node_t* first_fit(size_t allocation_size, node_t** selected_prev) {
-    node_t* prev = NULL;
-    node_t* current = free_list;
+//Entry of a stack in profile_stacks, added on first use. Returns NULL once the table is full.
+static profile_stack_t* profile_intern(void** frames, int depth, uint64_t hash) {
+    size_t i = (size_t)(hash >> (64 - PROFILE_STACK_BITS));
 
-    while (current != NULL) {
-        if (current->size >= allocation_size) {
-            *selected_prev = prev;
-            return current;
+    while (profile_stacks[i].hash != 0) {
+        if (profile_stacks[i].hash == hash && profile_stacks[i].depth == depth &&
+            memcmp(profile_stacks[i].frames, frames, depth * sizeof(void* )) == 0) {
+            return &profile_stacks[i];
         }
-        prev = current;
-        current = current->next;
+        i = (i + 1) & (PROFILE_STACKS - 1);
     }
-    return NULL;
+    if (profile_stack_count >= PROFILE_STACKS / 4 * 3) {
+        return NULL;
+    }
+    profile_stack_count++;
+    profile_stacks[i].hash = hash;
+    profile_stacks[i].depth = depth;
+    memcpy(profile_stacks[i].frames, frames, depth * sizeof(void* ));
+    return &profile_stacks[i];
 }
 
-//Best Fit algorithm: Find the smallest block that fits the requested size
-node_t* best_fit(size_t allocation_size, node_t** selected_prev) {
-    node_t* prev = NULL;
-    node_t* current = free_list;
-    node_t* best = NULL;
-    *selected_prev = NULL;
-
-    while (current != NULL) {
-        if (current->size >= allocation_size &&
-            (best == NULL || current->size < best->size)) {
-            best = current;
-          *  selected_prev = prev;
+//Takes a block out of profile_blocks, called with the profile lock held. Entries after it are moved
+//back into the gap while their home slot allows, so lookups never need tombstones.
+static void profile_remove(size_t i) {
+    profile_block_t* block = &profile_blocks[i];
+    block->stack->live_count--;
+    block->stack->live_bytes -= block->size;
+    __atomic_sub_fetch(&profile_filter[profile_slot(block->ptr)], 1, __ATOMIC_RELAXED);
+    profile_block_count--;
+
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & (PROFILE_BLOCKS - 1);
+        if (profile_blocks[j].ptr == NULL) {
+            break;
+        }
+        size_t home = profile_slot(profile_blocks[j].ptr);
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            profile_blocks[i] = profile_blocks[j];
+            i = j;
         }
-        prev = current;
-        current = current->next;
     }
-    return best;
+    profile_blocks[i].ptr = NULL;
 }
 
-//Worst Fit algorithm: Find the largest block that fits the requested size
-node_t* worst_fit(size_t allocation_size, node_t** selected_prev) {
-    node_t* prev = NULL;
-    node_t* current = free_list;
-    node_t* worst = NULL;
-    *selected_prev = NULL;
+//Records a sampled block with the stack of its allocation. The profiler's own frames are cut off, so
+//a stack starts in the public call, which returns to caller.
+static void profile_sample(void* ptr, size_t size, void* caller) {
+    void* frames[PROFILE_DEPTH + 4];
 
-    while (current != NULL) {
-        if (current->size >= allocation_size &&
-            (worst == NULL || current->size > worst->size)) {
-            worst = current;
-            *selected_prev = prev;
+    //The unwinder is loaded on first use, so the priming call in umemprofile has already allocated
+    profile_busy = true;
+    int total = backtrace(frames, PROFILE_DEPTH + 4);
+    profile_busy = false;
+
+    int first = 0;
+    while (first < total && frames[first] != caller) {
+        first++;
+    }
+    if (first == total) {
+        first = 0;
+    }
+    int depth = total - first < PROFILE_DEPTH ? total - first : PROFILE_DEPTH;
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[first + i]) * 0x100000001B3ULL;
+    }
+    hash |= 1;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_stack_t* stack = profile_intern(frames + first, depth, hash);
+    if (stack == NULL || profile_block_count >= PROFILE_BLOCKS / 4 * 3) {
+        profile_dropped++;
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+
+    //A block left over from a free that raced with this allocation is dropped first
+    size_t i = profile_slot(ptr);
+    while (profile_blocks[i].ptr != NULL) {
+        if (profile_blocks[i].ptr == ptr) {
+            profile_remove(i);
+            i = profile_slot(ptr);
+            continue;
         }
-        prev = current;
-        current = current->next;
+        i = (i + 1) & (PROFILE_BLOCKS - 1);
     }
-    return worst;
+    profile_blocks[i].ptr = ptr;
+    profile_blocks[i].size = size;
+    profile_blocks[i].stack = stack;
+    __atomic_add_fetch(&profile_filter[profile_slot(ptr)], 1, __ATOMIC_RELAXED);
+    profile_block_count++;
+
+    stack->live_count++;
+    stack->live_bytes += size;
+    stack->alloc_count++;
+    stack->alloc_bytes += size;
+    pthread_mutex_unlock(&profile_lock);
 }
 
-//Next Fit algorithm: Find the next block from the last allocated block
-node_t* next_fit(size_t allocation_size, node_t** selected_prev) {
-    if (free_list == NULL) {
-        return NULL;  //No free blocks available
+//Drops a block from the profile if it was sampled
+static void profile_forget(void* ptr) {
+    if (__atomic_load_n(&profile_filter[profile_slot(ptr)], __ATOMIC_RELAXED) == 0) {
+        return;
     }
 
-    node_t* prev = NULL;
-    node_t* current;
-
-    //Start the search from the node immediately after last_allocated, or from the head if last_allocated is NULL
-    if (last_allocated == NULL || last_allocated->next == NULL) {
-        current = free_list;
-        prev = NULL;
-    } else {
-        current = last_allocated->next;
-        prev = last_allocated;
+    pthread_mutex_lock(&profile_lock);
+    for (size_t i = profile_slot(ptr); profile_blocks[i].ptr != NULL; i = (i + 1) & (PROFILE_BLOCKS - 1)) {
+        if (profile_blocks[i].ptr == ptr) {
+            profile_remove(i);
+            break;
+        }
     }
+    pthread_mutex_unlock(&profile_lock);
+}
 
-    //Keep a pointer to the start of our search to know when we've wrapped around
-    node_t* start = current;
+//Profiler side of trace_event. Frees are seen before the block is released and allocations after
+//they return, like in a trace. A urealloc releases its old block unless it failed.
+void profile_event(int op, void* ptr, size_t argument, size_t size, void* caller) {
+    if (profile_busy) {
+        return;
+    }
 
-    //Search from current to the end of the free list, wrapping around if necessary
-    do {
-        if (current->size >= allocation_size) {
-            //We found a suitable block, so set last_allocated and return
-            *selected_prev = prev;
-            last_allocated = current;
-            return current;
+    if (op == UMEM_TRACE_FREE || op == UMEM_TRACE_FREE_SIZED) {
+        if (ptr != NULL) {
+            profile_forget(ptr);
         }
+        return;
+    }
+    if (op == UMEM_TRACE_REALLOC && argument != 0 && (ptr != NULL || size == 0)) {
+        profile_forget((void* )argument);
+    }
 
-        //Move to the next node
-        prev = current;
-        current = current->next ? current->next : free_list;  //Wrap around if at the end
-    } while (current != start);
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+    if (ptr == NULL || rate == 0) {
+        return;
+    }
 
-    //No suitable block found
-    return NULL;
+    //A thread starts with a countdown of its own
+    if (profile_random == 0) {
+        profile_random = ((uintptr_t)&profile_random ^ (uint64_t)trace_clock()) | 1;
+        profile_countdown = profile_interval(rate);
+    }
+    profile_countdown -= (long)size;
+    if (profile_countdown > 0) {
+        return;
+    }
+    profile_countdown = profile_interval(rate);
+    profile_sample(ptr, size, caller);
 }
 
-//Debugger for checking the free list
-void print_free_list() {
-    node_t* current = free_list;
-    printf("Free list: ");
-    while (current != NULL) {
-        printf("%p: %zu", (void*)current, current->size);
-        current = current->next;
-        if (current != NULL) {
-            printf(", ");
+int umemprofile(size_t rate) {
+    pthread_mutex_lock(&profile_lock);
+    if (rate > 0 && !profiling) {
+        //Tables are mapped rather than allocated, and pages are only touched as they fill up
+        size_t stacks_size = PROFILE_STACKS * sizeof(profile_stack_t);
+        size_t blocks_size = PROFILE_BLOCKS * sizeof(profile_block_t);
+        size_t filter_size = PROFILE_BLOCKS * sizeof(unsigned short);
+        char* tables = mmap(NULL, stacks_size + blocks_size + filter_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (tables == MAP_FAILED) {
+            pthread_mutex_unlock(&profile_lock);
+            perror("Failed to map the profile tables");
+            return -1;
         }
+        profile_stacks = (profile_stack_t* )tables;
+        profile_blocks = (profile_block_t* )(tables + stacks_size);
+        profile_filter = (unsigned short* )(tables + stacks_size + blocks_size);
+
+        void* frame;
+        profile_busy = true;
+        backtrace(&frame, 1);
+        profile_busy = false;
+        __atomic_store_n(&profiling, 1, __ATOMIC_RELEASE);
     }
-    printf("\n");
+    if (rate > 0) {
+        profile_last_rate = rate;
+    }
+    __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profile_lock);
+    return 0;
 }
 
-double calculate_fragmentation(void) {
-    double fragmentation = 0.0;
-    size_t largest_free_block_size = 0;
-    size_t total_small_free_blocks = 0;
-    node_t* current = free_list;
+//Writes the profile in the legacy heap profile format pprof reads. Each stack carries its live
+//blocks and every block ever sampled there, so one file gives both the inuse and the alloc views,
+//and heap_v2 tells pprof to scale the samples back up by the rate.
+int umemprofile_dump(const char* path) {
+    if (!__atomic_load_n(&profiling, __ATOMIC_ACQUIRE)) {
+        fprintf(stderr, "The heap profiler has not been started.\n");
+        return -1;
+    }
 
-    //First pass: Find the largest free block size
-    while (current != NULL) {
-        if (current->size > largest_free_block_size) {
-            largest_free_block_size = current->size;
-        }
-        current = current->next;
+    //Allocations made while writing the file are not sampled, the profile lock is held meanwhile
+    profile_busy = true;
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to open profile file");
+        profile_busy = false;
+        return -1;
     }
 
-    //If there is no free memory, fragmentation is zero
-    if (largest_free_block_size == 0 || free_memory == 0) {
-        fragmentation = 0.0;
-    } else {
-        //Define threshold as half the size of the largest free block
-        size_t threshold = largest_free_block_size / 2;
-
-        //Second pass: Sum up memory in small free blocks
-        current = free_list;
-        while (current != NULL) {
-            if (current->size < threshold) {
-                total_small_free_blocks += current->size;
-            }
-            current = current->next;
+    pthread_mutex_lock(&profile_lock);
+    uint64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < PROFILE_STACKS; i++) {
+        live_count += profile_stacks[i].live_count;
+        live_bytes += profile_stacks[i].live_bytes;
+        alloc_count += profile_stacks[i].alloc_count;
+        alloc_bytes += profile_stacks[i].alloc_bytes;
+    }
+    fprintf(file, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+            (unsigned long long)live_count, (unsigned long long)live_bytes,
+            (unsigned long long)alloc_count, (unsigned long long)alloc_bytes, profile_last_rate);
+
+    for (size_t i = 0; i < PROFILE_STACKS; i++) {
+        profile_stack_t* stack = &profile_stacks[i];
+        if (stack->alloc_count == 0) {
+            continue;
         }
-
-        //Calculate fragmentation percentage
-        fragmentation = ((double)total_small_free_blocks / (double)free_memory) * 100.0;
+        fprintf(file, "%llu: %llu [%llu: %llu] @", (unsigned long long)stack->live_count,
+                (unsigned long long)stack->live_bytes, (unsigned long long)stack->alloc_count,
+                (unsigned long long)stack->alloc_bytes);
+        for (int f = 0; f < stack->depth; f++) {
+            fprintf(file, " %p", stack->frames[f]);
+        }
+        fprintf(file, "\n");
+    }
+    unsigned long dropped = profile_dropped;
+    pthread_mutex_unlock(&profile_lock);
+
+    //pprof symbolizes the addresses with the mappings of the process
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char buffer[4096];
+        ssize_t length;
+        while ((length = read(maps, buffer, sizeof(buffer))) > 0) {
+            fwrite(buffer, 1, (size_t)length, file);
+        }
+        close(maps);
     }
 
-    return fragmentation;
-}
+    int result = ferror(file) ? -1 : 0;
+    if (fclose(file) != 0) {
+        result = -1;
+    }
+    profile_busy = false;
 
-//Function to log memory operations for image generation
-/*void log_memory_operation(const char* operation, void* address, size_t size) {
-    FILE* file = fopen("memory_log.txt", "a");
-    if (file == NULL) {
-        perror("Failed to open memory log file");
-        return;
+    if (dropped > 0) {
+        fprintf(stderr, "Profile dropped %lu samples, its tables are full.\n", dropped);
     }
-    fprintf(file, "%s %p %zu\n", operation, address, size);
-    fclose(file);
-}*/
\ No newline at end of file
+    return result;
+}
@@ -2,6 +2,7 @@
 #define _UMEM_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #define MAGIC 0xDEADBEEFLL          // Magic number used for detecting memory corruption
@@ -11,29 +12,153 @@
 #define FIRST_FIT 					(3)
 #define NEXT_FIT 					(4)
 #define BUDDY						(5)
+#define TLSF						(6)
+#define UMEM_BUMP					(7)		// Bump allocation, for umem_heap_create only
+
+//Options that can be OR'd into the allocation algorithm passed to umeminit
+#define UMEM_THREAD_SAFE			(1 << 8)	// Lock the heap and give each thread a cache of small blocks
+#define UMEM_ALGORITHM_MASK			(0xff)
+
+//Options for umemopt, set before umeminit
+#define UMEM_OPT_ARENAS				(1)		// Number of arenas the region is split into (1-64)
+#define UMEM_OPT_ARENA_SELECT		(2)		// How a thread picks its arena
+#define UMEM_ARENA_PER_CPU			(0)		// Use the arena of the CPU the thread runs on
+#define UMEM_ARENA_ROUND_ROBIN		(1)		// Hand arenas to threads in turn
+#define UMEM_OPT_HEAP_LIMIT			(3)		// Size in bytes the heap may grow to, 0 keeps the region fixed
+#define UMEM_OPT_PURGE_DECAY		(4)		// Milliseconds dirty free pages may stay before a purge, 0 disables
+#define UMEM_OPT_PURGE_THRESHOLD	(5)		// Dirty free bytes that trigger a purge, 0 disables
+#define UMEM_OPT_HUGE_PAGES			(6)		// Page size backing the region
+#define UMEM_HUGE_NONE				(0)		// Regular pages
+#define UMEM_HUGE_TRANSPARENT		(1)		// Transparent huge pages (MADV_HUGEPAGE)
+#define UMEM_HUGE_TLB				(2)		// MAP_HUGETLB, falling back to transparent huge pages
+#define UMEM_OPT_PREFAULT			(7)		// Fault the region in at umeminit instead of on first touch
+#define UMEM_PREFAULT_NONE			(0)		// Fault pages in on first touch
+#define UMEM_PREFAULT_POPULATE		(1)		// Populate committed memory up front
+#define UMEM_PREFAULT_LOCK			(2)		// Lock committed memory into RAM (mlock)
+#define UMEM_OPT_MMAP_THRESHOLD		(8)		// Requests of at least this many bytes get their own mapping, 0 disables
+#define UMEM_OPT_SIZE_CLASSES		(9)		// Requests up to this many bytes (at most 1024) come from headerless size classes, 0 disables
+#define UMEM_OPT_QUICK_BINS			(10)	// Freed blocks up to this many bytes (at most 512) are reused before coalescing, 0 disables
+#define UMEM_OPT_QUIET				(11)	// 1 makes failed requests return NULL without a message on stderr
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // structures : Both structures are required and are 64 bit. 
-//              These structures are each 16 bytes in length.
+//              header_t is 16 bytes in length, node_t is 24 bytes.
+//              Building with -DUMEM_COMPACT_HEADER shrinks header_t to 8 bytes
+//              with a 32-bit size and magic, which limits arenas to 4 GiB.
 //
+#ifdef UMEM_COMPACT_HEADER
+typedef unsigned int block_word_t;
+#else
+typedef long block_word_t;
+#endif
+
 typedef struct {
-    long size;              // Size of the block
-    long magic;             // Magic number for integrity check
+    block_word_t size;      // Size of the block
+    block_word_t magic;     // Magic number for integrity check
 } header_t;
 
 typedef struct __node_t {
-    long size;              // Size of the free block
+    block_word_t size;      // Size of the free block
+#ifdef UMEM_COMPACT_HEADER
+    block_word_t magic;     // Keeps the links aligned, cleared when the block is freed
+#endif
     struct __node_t *next;  // Pointer to the next free block
+    struct __node_t *prev;  // Pointer to the previous free block (segregated lists)
 } node_t;
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// umem_cache_t : Object cache handing out fixed-size objects without headers.
+//
+typedef struct umem_cache umem_cache_t;
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// umem_heap_t : Private heap carved from the region, used by one thread at a time.
+//
+typedef struct umem_heap umem_heap_t;
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// umem_stats_t : Snapshot filled in by umemstats_get. The counters are kept up
+//              to date on every operation, so taking one never walks the heap.
+//
+#define UMEM_STATS_BUCKETS			(64)	// Buckets of the free block histogram, one per power of two
+#define UMEM_STATS_TEXT				(0)		// umemstats_export: one "name value" pair per line
+#define UMEM_STATS_JSON				(1)		// umemstats_export: one JSON object
+
+typedef struct {
+    uint64_t total_allocations;
+    uint64_t total_deallocations;
+    uint64_t allocated_memory;      // Usable bytes in allocated blocks and cache objects, direct mappings included
+    uint64_t free_memory;           // Bytes in free blocks, headers included
+    uint64_t mapped_memory;         // Usable bytes in direct mappings
+    uint64_t purged_memory;         // Free bytes whose pages were given back to the OS
+    uint64_t quick_blocks;          // Blocks parked in the quick bins
+    uint64_t quick_bytes;
+    uint64_t header_overhead;       // Bytes taken by the headers of live blocks and by slabs outside their live objects
+    uint64_t free_blocks;
+    uint64_t largest_free_block;    // Exact, except for first fit, next fit and TLSF when several blocks share its bucket or list, then an upper bound
+    double fragmentation;           // Percentage of free memory in blocks below half the largest
+    uint64_t free_histogram[UMEM_STATS_BUCKETS];   // Free blocks of 2^i to 2^(i+1) - 1 bytes
+} umem_stats_t;
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // function prototypes
 //
 int 	umeminit(size_t sizeOfRegion, int allocationAlgo);
 void 	*umalloc(size_t size);
+void    *umemalign(size_t alignment, size_t size);
+void    *ualigned_alloc(size_t alignment, size_t size);
+void    *ucalloc(size_t n, size_t size);
 void    *urealloc(void *ptr, size_t size);
 void 	ufree(void *ptr);
+void    ufree_sized(void *ptr, size_t size);
+size_t  umalloc_batch(size_t size, size_t n, void **out);
+void    ufree_batch(void **ptrs, size_t n);
+size_t  umalloc_usable_size(void *ptr);
 void    umemstats(void);
+int     umemstats_get(umem_stats_t *stats);
+int     umemstats_export(FILE *out, int format);
+int     umemopt(int option, long value);
+size_t  umemtrim(void);
+void    umemconsolidate(void);
+int     umemtrace(const char *path);
+int     umemprofile(size_t rate);
+int     umemprofile_dump(const char *path);
+
+umem_cache_t *umem_cache_create(const char *name, size_t size, size_t align,
+                                void (*constructor)(void *), void (*destructor)(void *));
+void    *umem_cache_alloc(umem_cache_t *cache);
+void    umem_cache_free(umem_cache_t *cache, void *obj);
+void    umem_cache_destroy(umem_cache_t *cache);
+
+umem_heap_t *umem_heap_create(size_t size, int algorithm);
+void    *umem_heap_alloc(umem_heap_t *heap, size_t size);
+void    umem_heap_free(umem_heap_t *heap, void *ptr);
+void    umem_heap_reset(umem_heap_t *heap);
+size_t  umem_heap_mark(umem_heap_t *heap);
+void    umem_heap_rollback(umem_heap_t *heap, size_t mark);
+void    umem_heap_destroy(umem_heap_t *heap);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// umem_trace_record_t : One operation of a trace written by umemtrace. The file
+//              starts with UMEM_TRACE_MAGIC and holds the records of each thread
+//              in time order, the threads' batches interleaved. Blocks are given
+//              as offsets from the region base, 0 standing for NULL.
+//
+#define UMEM_TRACE_MAGIC			"UMEMTRC1"
+#define UMEM_TRACE_MALLOC			(1)		// umalloc(size), one per block of umalloc_batch
+#define UMEM_TRACE_CALLOC			(2)		// ucalloc, size is the product of both arguments
+#define UMEM_TRACE_MEMALIGN			(3)		// umemalign(argument, size)
+#define UMEM_TRACE_REALLOC			(4)		// urealloc(argument, size) returning address
+#define UMEM_TRACE_FREE				(5)		// ufree, one per block of ufree_batch
+#define UMEM_TRACE_FREE_SIZED		(6)		// ufree_sized(address, size)
+
+typedef struct {
+    uint64_t time;          // Nanoseconds since the trace started
+    uint64_t address;       // Block allocated or freed
+    uint64_t argument;      // Old block of a urealloc, alignment of a umemalign
+    uint64_t size : 56;     // Requested size
+    uint64_t op : 8;        // One of UMEM_TRACE_*
+} umem_trace_record_t;
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 /**
@@ -56,8 +181,8 @@ void    umemstats(void);
  #define printumemstats(total_allocations, total_deallocations, allocated_memory, free_memory, fragmentation) \
     do {                                                                                                   \
         printf("Memory Allocation Statistics:\n");                                                        \
-        printf("Total Allocations: %d\n", total_allocations);                                             \
-        printf("Total Deallocations: %d\n", total_deallocations);                                         \
+        printf("Total Allocations: %llu\n", (unsigned long long)(total_allocations));                     \
+        printf("Total Deallocations: %llu\n", (unsigned long long)(total_deallocations));                 \
         printf("Currently Allocated Memory: %zu bytes\n", allocated_memory);                              \
         printf("Currently Free Memory: %zu bytes\n", free_memory);                                        \
         printf("Memory Fragmentation: %.2f%%\n", fragmentation);                                          \